@@ -8,22 +8,75 @@
 // C99 source file
 //
 
+// POSIX builds (link with -pthread) have some additional fast paths:
+// MMAP 1 maps large inputs and outputs instead of using stdio
+// THREADS 1 spreads batch mode across a thread pool
+// REFLINK 1 clones the input and writes only the patched bytes (Linux only)
+#if defined(__unix__)
+#define _POSIX_C_SOURCE 200809L
+#define MMAP    1
+#define THREADS 1
+#else
+#define MMAP    0
+#define THREADS 0
+#endif
+#if defined(__linux__)
+#define _GNU_SOURCE
+#define REFLINK 1
+#else
+#define REFLINK 0
+#endif
+
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(__unix__)
+#include <dirent.h>
+#include <unistd.h>
+#define PATH_SEP '/'
+#else
+#include <direct.h>
+#include <fcntl.h>
+#include <io.h>
+#define PATH_SEP '\\'
+#endif
+#if MMAP || REFLINK
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#if REFLINK
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int) // from linux/fs.h, which conflicts with BLOCK_SIZE
+#endif
+#endif
+#if THREADS
+#include <pthread.h>
+#endif
 
-const int debug = 0; // 1 = lists each patch applied
 // TEST 1 will operate on both 1MM.EXE and 3MM.EXE
 #define TEST 0
+// BENCH 1 builds a benchmark of the patch engines and CRC32 instead of the patcher
+#define BENCH 0
+// CYCLES 1 builds an 8086 interpreter that times the injected routines instead of the patcher
+#define CYCLES 0
+// FUZZ 1 builds a differential test of the patch engines against a per-byte reference instead of the patcher
+// FUZZ 2 builds the same test as a libFuzzer target (clang -fsanitize=fuzzer)
+#define FUZZ 0
+// LIBRARY 1 leaves out main, to build the patcher into another program (see Library below)
+#define LIBRARY 0
 
 typedef uint32_t     uint32;
 typedef uint16_t     uint16;
 typedef uint8_t      uint8;
 typedef unsigned int uint;
 
-// MM.EXE CRC32 to identify which file is present
-const uint32 CRC_MM1 = 0xAEA06825;
-const uint32 CRC_MM3 = 0x06C09829;
-
 #if !TEST
 #define FILE_MM1    "MM.EXE"
 #define FILE_MM3    "MM.EXE"
@@ -52,6 +105,8 @@ typedef struct
 #define JMP(src,dst)   (0xE9),WORD((dst)-(src)-3)
 
 const uint8 six[] = { 6 };
+const uint8 five[] = { 5 };
+const uint8 mz[] = { 'M', 'Z' };
 
 // New data from the patch is placed over top of existing unuused code so that
 // the resulting executable will have the same memory footprint as before.
@@ -67,6 +122,7 @@ const uint8 six[] = { 6 };
 // Additionally, the executables had been packed by MASM EXEPACK.
 // The following utility was used to unpack them for analysis:
 // https://github.com/w4kfu/unEXEPACK
+// The patches are applied to the packed file, and -unpack can write the result unpacked.
 
 // Each patch applied has a segment address where it will reside in memory when loaded,
 // and also a file offset where it resides in the original executable file.
@@ -127,19 +183,19 @@ const uint8 mm1_slow[] = {
 #define mm1_slow0_addr   0x5390
 #define mm1_slow0_file   0x4BFE
 const uint8 mm1_slow0[] = { CALL(mm1_slow0_addr,mm1_slow_addr), 0x90, 0x90, 0x90 };
-// only the main game loop is patched, but several other input poll candidates were found,
+// only the main game loop is patched by default, but several other input poll candidates were found,
 // searching for uses of cs:1149h which is the joystick setting flag:
 // address (file offset)
-// 49B6h (4224)
-// 4A23h (4291)
+// 49B6h (4224) - wait screen, -poll vsync
+// 4A23h (4291) - wait screen, -poll vsync
 // 4B07h (4375) - followed by joystick calibration rather than polling
-// 4DA5h (4613)
+// 4DA5h (4613) - select screen, -poll full
 // 4E67h (47D5) - not followed by a poll
 // 50DFh (494D) - setup menu initializing setting
 // 50EDh (495B) - setup menu initializing setting
 // 5284h (4AF2) - followed by calibration rather than poll
-// 52C5h (4B33)
-// 53EDh (4C5B)
+// 52C5h (4B33) - wait screen, -poll vsync
+// 53EDh (4C5B) - wait screen, -poll vsync
 
 // text table for a revised setup menu
 const uint8 mm1_table[] = {
@@ -255,51 +311,57 @@ const uint8 mm1_settings0[] = {
 // path for the original calibrate routine
 #define mm1_joy1_addr   0x17EA
 #define mm1_joy1_file   0x1058
+// PIT counts to wait for the one-shots, about 2.5 ms
+#define joy_timeout     6000
 const uint8 mm1_joy[] = {
 	// joystick variable storage
-	WORD(0),  // joy_x_accum for temporary average of polling
-	WORD(10), // joy_x_low threshold for left
-	WORD(30), // joy_x_high threshold for right
-	WORD(0),  // joy_y_accum
-	WORD(10), // joy_y_low threshold for up
-	WORD(30), // joy_y_high threshold for down
-	// joystick poll based on mega man 3 (+12)
-	// assume: ds = cs
+	WORD(900),  // joy_x_low threshold for left
+	WORD(1500), // joy_x_high threshold for right
+	WORD(900),  // joy_y_low threshold for up
+	WORD(1500), // joy_y_high threshold for down
+	// joystick poll (+8)
+	// times a single decay of the joystick one-shots against PIT channel 0,
+	// so the result is the same on any CPU, and interrupts are only disabled
+	// until joy_timeout ticks have passed even if an axis never returns
 	// assume: dx = 0201h (joystick port)
-	0xC7, 0x06, WORD(mm1_joy_addr+0), WORD(0), // mov joy_x_accum, 0
-	0xC7, 0x06, WORD(mm1_joy_addr+6), WORD(0), // mov joy_y_accum, 0
-	0xB9, 0x04, 0x00,                          // mov cx, 4
-	                                           //average:
-	0x51,                                      // push cx
-	0x33, 0xC9,                                // xor cx, cx
-	0x33, 0xFF,                                // xor di, di
-	0x33, 0xF6,                                // xor si, si
-	0x32, 0xC0,                                // xor al, al
+	// out: di, si = x, y time in PIT counts (2 per 1193182 Hz clock in mode 3)
+	0x31, 0xFF,                                // xor di, di
+	0x31, 0xF6,                                // xor si, si
+	0x31, 0xDB,                                // xor bx, bx ; elapsed
 	0xFA,                                      // cli
+	CALL(mm1_joy_addr+15,mm1_joy_addr+59),     // call read_pit
+	0x89, 0xC1,                                // mov cx, ax ; previous count
 	0xEE,                                      // out dx, al
 	                                           //read_loop:
+	CALL(mm1_joy_addr+21,mm1_joy_addr+59),     // call read_pit
+	0x91,                                      // xchg cx, ax
+	0x29, 0xC8,                                // sub ax, cx ; counts since last read
+	0x3D, WORD(1000),                          // cmp ax, 1000
+	0x77, 0x02,                                // ja +2 ; counter reloaded, drop this step
+	0x01, 0xC3,                                // add bx, ax
 	0xEC,                                      // in al, dx
 	0xA8, 0x01,                                // test al, 1
-	0x74, 0x01,                                // jz +1
-	0x47,                                      // inc di
+	0x74, 0x02,                                // jz +2
+	0x89, 0xDF,                                // mov di, bx
 	0xA8, 0x02,                                // test al, 2
-	0x74, 0x01,                                // jz +1
-	0x46,                                      // inc si
+	0x74, 0x02,                                // jz +2
+	0x89, 0xDE,                                // mov si, bx
 	0xA8, 0x03,                                // test al, 3
-	0xE0, 0xF1,                                // loopne read_loop
+	0x74, 0x06,                                // jz done
+	0x81, 0xFB, WORD(joy_timeout),             // cmp bx, joy_timeout
+	0x72, 0xDC,                                // jb read_loop
+	                                           //done:
 	0xFB,                                      // sti
-	0x01, 0x3E, WORD(mm1_joy_addr+0),          // add joy_x_accum, di
-	0x01, 0x36, WORD(mm1_joy_addr+6),          // add joy_y_accum, si
-	0x59,                                      // pop cx
-	0xE2, 0xDA,                                // loop average
-	0x8B, 0x3E, WORD(mm1_joy_addr+0),          // mov di, joy_x_accum
-	0x8B, 0x36, WORD(mm1_joy_addr+6),          // mov si, joy_y_accum
-	0xD1, 0xEF,                                // shr di, 1
-	0xD1, 0xEF,                                // shr di, 1
-	0xD1, 0xEE,                                // shr si, 1
-	0xD1, 0xEE,                                // shr si, 1
 	0xC3,                                      // retn
-	// joystick calibrate based on mega man 3 (+82)
+	// read_pit (+59)
+	0xB0, 0x00,                                // mov al, 0 ; latch counter 0
+	0xE6, 0x43,                                // out 43h, al
+	0xE4, 0x40,                                // in al, 40h
+	0x88, 0xC4,                                // mov ah, al
+	0xE4, 0x40,                                // in al, 40h
+	0x86, 0xC4,                                // xchg ah, al
+	0xC3,                                      // retn
+	// joystick calibrate based on mega man 3 (+72)
 	// sets the low/high thresholds at 25% +/-
 	0x9C,                                      // pushf
 	0x1E,                                      // push ds
@@ -310,19 +372,19 @@ const uint8 mm1_joy[] = {
 	0x52,                                      // push dx
 	0x8C, 0xC8,                                // mov ax, cs
 	0x8E, 0xD8,                                // mov ds, ax
-	CALL(mm1_joy_addr+93,mm1_joy_addr+12),     // call joystick poll
-	0x89, 0x3E, WORD(mm1_joy_addr+2),          // mov joy_x low, di
-	0x89, 0x3E, WORD(mm1_joy_addr+4),          // mov joy_x high, di
+	CALL(mm1_joy_addr+83,mm1_joy_addr+8),      // call joystick poll
+	0x89, 0x3E, WORD(mm1_joy_addr+0),          // mov joy_x low, di
+	0x89, 0x3E, WORD(mm1_joy_addr+2),          // mov joy_x high, di
 	0xD1, 0xEF,                                // shr di, 1
 	0xD1, 0xEF,                                // shr di, 1
-	0x29, 0x3E, WORD(mm1_joy_addr+2),          // sub joy_x low, di
-	0x01, 0x3E, WORD(mm1_joy_addr+4),          // sub joy_x high, di
-	0x89, 0x36, WORD(mm1_joy_addr+8),          // mov joy_y low, si
-	0x89, 0x36, WORD(mm1_joy_addr+10),         // mov joy_y high, si
+	0x29, 0x3E, WORD(mm1_joy_addr+0),          // sub joy_x low, di
+	0x01, 0x3E, WORD(mm1_joy_addr+2),          // sub joy_x high, di
+	0x89, 0x36, WORD(mm1_joy_addr+4),          // mov joy_y low, si
+	0x89, 0x36, WORD(mm1_joy_addr+6),          // mov joy_y high, si
 	0xD1, 0xEE,                                // shr si, 1
 	0xD1, 0xEE,                                // shr si, 1
-	0x29, 0x36, WORD(mm1_joy_addr+8),          // sub joy_y low, si
-	0x01, 0x36, WORD(mm1_joy_addr+10),         // sub joy_y high, si          
+	0x29, 0x36, WORD(mm1_joy_addr+4),          // sub joy_y low, si
+	0x01, 0x36, WORD(mm1_joy_addr+6),          // sub joy_y high, si          
 	0x5A,                                      // pop dx
 	0x59,                                      // pop cx
 	0x58,                                      // pop ax
@@ -333,7 +395,7 @@ const uint8 mm1_joy[] = {
 	0xBB, WORD(0x4040),                        // mov bx, 4040h ; "fake" original calibration centre at 40h, 40h
 	0x88, 0x1E, WORD(0x114A),                  // mov joy_centre_x, bl ; replaces patched line at 17EA
 	0xC3,                                      // retn
-	// replacement for fragment of original joystick routine (+151)
+	// replacement for fragment of original joystick routine (+141)
 	// jmp from 174D, return to 175E
 	0x9C,                                      // pushf
 	0x1E,                                      // push ds
@@ -341,18 +403,18 @@ const uint8 mm1_joy[] = {
 	0x52,                                      // push dx
 	0x8C, 0xC8,                                // mov ax, cs
 	0x8E, 0xD8,                                // mov ds, cs
-	CALL(mm1_joy_addr+159,mm1_joy_addr+12),    // call poll
+	CALL(mm1_joy_addr+149,mm1_joy_addr+8),     // call poll
 	0xBB, WORD(0x4040),                        // mov bx, 4040h ; fake centre
-	0x3B, 0x3E, WORD(mm1_joy_addr+2),          // cmp di, joy_x low
+	0x3B, 0x3E, WORD(mm1_joy_addr+0),          // cmp di, joy_x low
 	0x77, 0x02,                                // ja +2
 	0xB3, 0x00,                                // mov bl, 0    ; fake up
-	0x3B, 0x3E, WORD(mm1_joy_addr+4),          // cmp di, joy_x high
+	0x3B, 0x3E, WORD(mm1_joy_addr+2),          // cmp di, joy_x high
 	0x72, 0x02,                                // jb +2
 	0xB3, 0x80,                                // mov bl, 0x80 ; fake down
-	0x3B, 0x36, WORD(mm1_joy_addr+8),          // cmp di, joy_y low
+	0x3B, 0x36, WORD(mm1_joy_addr+4),          // cmp di, joy_y low
 	0x77, 0x02,                                // ja +2
 	0xB7, 0x00,                                // mov bh, 0    ; fake up
-	0x3B, 0x36, WORD(mm1_joy_addr+10),         // cmp di, joy_y high
+	0x3B, 0x36, WORD(mm1_joy_addr+6),          // cmp di, joy_y high
 	0x72, 0x02,                                // jb +2
 	0xB7, 0x80,                                // mov bh, 0x80 ; fake down
 	0x31, 0xC0,                                // xor ax, ax
@@ -362,14 +424,14 @@ const uint8 mm1_joy[] = {
 	0x5F,                                      // pop di
 	0x1F,                                      // pop ds
 	0x9D,                                      // popf
-	JMP(mm1_joy_addr+207,mm1_joy0_addr+0x11),  // jmp 1753h
+	JMP(mm1_joy_addr+197,mm1_joy0_addr+0x11),  // jmp 1753h
 	// faked original poll: x,y => bl,bh = 00,40,80
 	// ax,cx,si = 0 ; post-conditions of the original fragment that was skipped
 };
 // patch for original poll
-const uint8 mm1_joy0[] = { JMP(mm1_joy0_addr,mm1_joy_addr+151), 0x90 };
+const uint8 mm1_joy0[] = { JMP(mm1_joy0_addr,mm1_joy_addr+141), 0x90 };
 // patch for original 
-const uint8 mm1_joy1[] = { CALL(mm1_joy1_addr,mm1_joy_addr+82), 0x90 };
+const uint8 mm1_joy1[] = { CALL(mm1_joy1_addr,mm1_joy_addr+72), 0x90 };
 
 // joystick fire button filter replacement for joystick poll
 const uint8 mm1_select[] = {
@@ -417,7 +479,6 @@ const uint8 mm1_mans[] = {
 	0x9C,                                     // pushf
 	0x50,                                     // push ax
 	0x53,                                     // push bx
-	0x51,                                     // push cx
 	0x52,                                     // push dx
 	0x1E,                                     // push ds
 	0x56,                                     // push si
@@ -428,29 +489,32 @@ const uint8 mm1_mans[] = {
 	                                          //poll_loop:
 	0x80, 0x3E, WORD(0x1149), 0x00,           // cmp joystick_enabled, 0
 	0x74, 22,                                 // jz kb_check
-	CALL(mm1_mans_addr+28,mm1_select_addr+1), // call filtered joystick poll ; wait for new press down
+	CALL(mm1_mans_addr+27,mm1_select_addr+1), // call filtered joystick poll ; wait for new press down
 	0xF6, 0x06, WORD(0x1204), 0x80,           // test input_bitfield, 80h
 	0x74, 0xEF,                               // jz poll_loop
 	                                          //hold_loop:
-	CALL(mm1_mans_addr+38,0x173C),            // call unfiltered joystick poll ; wait for release
+	CALL(mm1_mans_addr+37,0x173C),            // call unfiltered joystick poll ; wait for release
 	0xF6, 0x06, WORD(0x1204), 0x80,           // test input_bitfield, 80h
 	0x75, 0xF6,                               // jnz hold_loop
-	0xEB, 14,                                 // jump poll_end
-	                                          //kb_check:
-	0x80, 0x3E, WORD(0x1205), 0xB9,           // cmp kb_readcode, B9h ; spacebard key-up
-	0x74, 0x07,                               // jz poll_end
-	0x80, 0x3E, WORD(0x1205), 0x9C,           // cmp kb_readcode, 9Ch ; enter key-up
-	0x75, 0xF2,                               // jnz kb_check
+	0xEB, 16,                                 // jump poll_end
+	                                          //kb_check: ; idle until the keyboard interrupt
+	0xFA,                                     // cli
+	0xA0, WORD(0x1205),                       // mov al, kb_readcode
+	0x3C, 0xB9,                               // cmp al, B9h ; spacebar key-up
+	0x74, 0x08,                               // jz poll_end
+	0x3C, 0x9C,                               // cmp al, 9Ch ; enter key-up
+	0x74, 0x04,                               // jz poll_end
+	0xFB,                                     // sti ; takes effect after hlt begins, so no interrupt is missed
+	0xF4,                                     // hlt
+	0xEB, 0xF0,                               // jmp kb_check
 	                                          //poll_end:
 	0x5E,                                     // pop si
 	0x1F,                                     // pop ds
 	0x5A,                                     // pop dx
-	0x59,                                     // pop cx
 	0x5B,                                     // pop bx
 	0x58,                                     // pop ax
+	0x31, 0xC9,                               // xor cx, cx
 	0x9D,                                     // popf
-	0xB9, 0x01, 0x00,                         // mov cx, 1
-	0xE2, 0xFE,                               // loop -2
 	0xC3,                                     // retn
 	// postcondition of replaced wait loop: cx=0, flags from a loop
 };
@@ -463,6 +527,541 @@ const uint8 mm1_mans0[] = {
 	0x90,                                 // nop
 };
 
+// optional pacing of the other input polls (-poll)
+// The wait screens loop on a poll with no delay, so on a fast machine their animation runs too
+// fast and the CPU stays busy. Each real poll site listed above gets its own policy: full uses the
+// slowdown routine like the main loop, vsync waits for one retrace regardless of the speed setting,
+// and none leaves the site alone. Each site is just before the matching selectN poll call.
+
+// single retrace wait, placed after the room the -timer slowdown routine needs
+#define mm1_vsync_addr   (mm1_slow_addr+41)
+#define mm1_vsync_file   (mm1_slow_file+41)
+const uint8 mm1_vsync[] = {
+	0x9C,                                  // pushf
+	0x50,                                  // push ax
+	0x51,                                  // push cx
+	0x52,                                  // push dx
+	0xB9, WORD(1),                         // mov cx, 1
+	JMP(mm1_vsync_addr+7,mm1_slow_addr+7), // jmp slowdown ; continues at jcxz end
+};
+// replacing "cmp cs:1149h, 0" with a call, as mm1_slow0 does
+#define mm1_poll0_addr   0x49B6
+#define mm1_poll1_addr   0x4A23
+#define mm1_poll2_addr   0x4DA5
+#define mm1_poll3_addr   0x52C5
+#define mm1_poll4_addr   0x53ED
+#define mm1_poll0_file   0x4224
+#define mm1_poll1_file   0x4291
+#define mm1_poll2_file   0x4613
+#define mm1_poll3_file   0x4B33
+#define mm1_poll4_file   0x4C5B
+const uint8 mm1_poll0[] = { CALL(mm1_poll0_addr, mm1_vsync_addr), 0x90, 0x90, 0x90 };
+const uint8 mm1_poll1[] = { CALL(mm1_poll1_addr, mm1_vsync_addr), 0x90, 0x90, 0x90 };
+const uint8 mm1_poll2[] = { CALL(mm1_poll2_addr, mm1_slow_addr), 0x90, 0x90, 0x90 }; // select screen
+const uint8 mm1_poll3[] = { CALL(mm1_poll3_addr, mm1_vsync_addr), 0x90, 0x90, 0x90 };
+const uint8 mm1_poll4[] = { CALL(mm1_poll4_addr, mm1_vsync_addr), 0x90, 0x90, 0x90 };
+
+const patch mm1_poll_patch[] =
+{
+	{ mm1_vsync_file, LENGTH(mm1_vsync), mm1_vsync },
+	{ mm1_poll0_file, LENGTH(mm1_poll0), mm1_poll0 },
+	{ mm1_poll1_file, LENGTH(mm1_poll1), mm1_poll1 },
+	{ mm1_poll2_file, LENGTH(mm1_poll2), mm1_poll2 },
+	{ mm1_poll3_file, LENGTH(mm1_poll3), mm1_poll3 },
+	{ mm1_poll4_file, LENGTH(mm1_poll4), mm1_poll4 },
+	{0,0,NULL}
+};
+
+// optional timer slowdown (-timer)
+// Polling for vertical retrace keeps the CPU busy for the whole delay, which under an
+// emulator costs a host core per running instance. Instead PIT channel 0 is reprogrammed
+// to interrupt at a rate chosen for the frame rate setting, and the slowdown waits with HLT
+// for a deadline that advances by a fixed number of ticks each frame, so time left over from
+// a fast frame is not lost and the average rate is exact. A frame that misses its deadline
+// starts the schedule over from the current tick instead of hurrying the frames after it.
+// The timer is installed the first time it is needed. The original INT 8 handler is still called
+// at the BIOS rate of 18.2 Hz, and INT 21h is hooked to put everything back when the game exits.
+// This assumes the game leaves PIT channel 0 at its BIOS default and does not hook INT 8 itself.
+
+// the same dead Tandy code as above, in the unused space after the earlier patches
+#define mm1_toggle_addr     0x2494
+#define mm1_timer_addr      0x2524
+#define mm1_rate_addr       0x25C0
+#define mm1_toggle_file     0x1D02
+#define mm1_timer_file      0x1D92
+#define mm1_rate_file       0x1E2E
+
+// PIT divisor for an interrupt rate, even for square wave mode
+#define TIMER_DIVISOR(hz)   ((1193182UL / (hz) + 1) & ~1UL)
+// frame rate setting table entry: PIT divisor, ticks per frame
+#define TIMER_RATE(hz,k)    WORD(TIMER_DIVISOR(hz)), (k)
+
+// 5 = 23 Hz, the same as the default retrace slowdown on VGA
+#define timer_default   5
+
+// replaces mm1_slow, keeping its frame rate setting at +5
+const uint8 mm1_slow_timer[] = {
+	0x9C,                                            // pushf
+	0x50,                                            // push ax
+	0x51,                                            // push cx
+	0x52,                                            // push dx
+	0xB9, timer_default, 0x00,                       // mov cx, setting
+	0xE3, 0x03,                                      // jcxz end
+	CALL(mm1_slow_addr+9,mm1_rate_addr+45),          // call timer_limit
+	                                                 //end:
+	0x5A,                                            // pop dx
+	0x59,                                            // pop cx
+	0x58,                                            // pop ax
+	0x9D,                                            // popf
+	0x2E, 0x80, 0x3E, WORD(0x1149), 0x00,            // cmp cs:1149h, 0 ; joystick enabled
+	0xC3,                                            // retn
+	// idle until the next timer interrupt before a joystick poll (+23)
+	0x9C,                                            // pushf
+	0x2E, 0x80, 0x3E, WORD(mm1_timer_addr+12), 0x00, // cmp cs:timer_installed, 0
+	0x75, 0x03,                                      // jnz ready
+	CALL(mm1_slow_addr+32,mm1_toggle_addr),          // call timer_toggle
+	                                                 //ready:
+	0xFB,                                            // sti
+	0xF4,                                            // hlt
+	0x9D,                                            // popf
+	JMP(mm1_slow_addr+38,0x173C),                    // jmp joystick poll
+	// replaces mm1_vsync for -poll sites, idles until the next timer interrupt (+41)
+	0x9C,                                            // pushf
+	0x2E, 0x80, 0x3E, WORD(mm1_timer_addr+12), 0x00, // cmp cs:timer_installed, 0
+	0x75, 0x03,                                      // jnz ready
+	CALL(mm1_slow_addr+50,mm1_toggle_addr),          // call timer_toggle
+	                                                 //ready:
+	0xFB,                                            // sti
+	0xF4,                                            // hlt
+	0x9D,                                            // popf
+	0x2E, 0x80, 0x3E, WORD(0x1149), 0x00,            // cmp cs:1149h, 0 ; joystick enabled
+	0xC3,                                            // retn
+};
+// timer variables and interrupt handlers
+const uint8 mm1_timer[] = {
+	// timer variable storage, the vectors are swapped with the interrupt table by timer_toggle
+	WORD(mm1_timer_addr+13), WORD(0),          // old_int8
+	WORD(mm1_timer_addr+42), WORD(0),          // old_int21
+	WORD(0),                                   // timer_ticks
+	WORD(0),                                   // timer_chain
+	0x00,                                      // timer_installed
+	// INT 8 handler (+13)
+	0x50,                                      // push ax
+	0x2E, 0xFF, 0x06, WORD(mm1_timer_addr+8),  // inc cs:timer_ticks
+	0x2E, 0xA1, WORD(mm1_rate_addr+27),        // mov ax, cs:timer_divisor
+	0x2E, 0x01, 0x06, WORD(mm1_timer_addr+10), // add cs:timer_chain, ax ; carry every 65536 PIT clocks
+	0x72, 0x06,                                // jc chain
+	0xB0, 0x20,                                // mov al, 20h
+	0xE6, 0x20,                                // out 20h, al ; end of interrupt
+	0x58,                                      // pop ax
+	0xCF,                                      // iret
+	                                           //chain:
+	0x58,                                      // pop ax
+	0x2E, 0xFF, 0x2E, WORD(mm1_timer_addr+0),  // jmp far cs:old_int8 ; sends its own end of interrupt
+	// INT 21h handler (+42)
+	0x80, 0xFC, 0x4C,                          // cmp ah, 4Ch ; terminate
+	0x74, 0x0C,                                // jz exit
+	0x08, 0xE4,                                // or ah, ah ; terminate (old)
+	0x74, 0x05,                                // jz old
+	0x2E, 0xFF, 0x2E, WORD(mm1_timer_addr+4),  // jmp far cs:old_int21
+	                                           //old:
+	0xB8, WORD(0x4C00),                        // mov ax, 4C00h ; 00h would take the PSP from our CS
+	                                           //exit:
+	CALL(mm1_timer_addr+59,mm1_toggle_addr),   // call timer_toggle ; uninstall
+	0xCD, 0x21,                                // int 21h ; terminate with the restored vector
+};
+// installs or uninstalls the timer
+const uint8 mm1_toggle[] = {
+	0x9C,                                            // pushf
+	0x50,                                            // push ax
+	0x56,                                            // push si
+	0x57,                                            // push di
+	0x06,                                            // push es
+	0xFA,                                            // cli
+	0x2E, 0x80, 0x3E, WORD(mm1_timer_addr+12), 0x00, // cmp cs:timer_installed, 0
+	0x75, 0x0A,                                      // jnz swap
+	0x2E, 0x8C, 0x0E, WORD(mm1_timer_addr+2),        // mov cs:old_int8+2, cs ; our vectors until swapped
+	0x2E, 0x8C, 0x0E, WORD(mm1_timer_addr+6),        // mov cs:old_int21+2, cs
+	                                                 //swap:
+	0x31, 0xC0,                                      // xor ax, ax
+	0x8E, 0xC0,                                      // mov es, ax
+	0xBF, WORD(0x0020),                              // mov di, 0020h ; INT 8 vector
+	0xBE, WORD(mm1_timer_addr+0),                    // mov si, old_int8
+	CALL(mm1_toggle_addr+34,mm1_toggle_addr+73),     // call swap2
+	0xBF, WORD(0x0084),                              // mov di, 0084h ; INT 21h vector
+	CALL(mm1_toggle_addr+40,mm1_toggle_addr+73),     // call swap2
+	0xB0, 0x36,                                      // mov al, 36h ; channel 0, low/high byte, mode 3
+	0xE6, 0x43,                                      // out 43h, al
+	0x2E, 0x80, 0x36, WORD(mm1_timer_addr+12), 0x01, // xor cs:timer_installed, 1
+	0x2E, 0xA1, WORD(mm1_rate_addr+27),              // mov ax, cs:timer_divisor
+	0x75, 0x02,                                      // jnz +2
+	0x31, 0xC0,                                      // xor ax, ax ; 65536 is the BIOS default
+	0xE6, 0x40,                                      // out 40h, al
+	0x88, 0xE0,                                      // mov al, ah
+	0xE6, 0x40,                                      // out 40h, al
+	0x07,                                            // pop es
+	0x5F,                                            // pop di
+	0x5E,                                            // pop si
+	0x58,                                            // pop ax
+	0x9D,                                            // popf
+	0xC3,                                            // retn
+	                                                 //swap2: ; exchanges 2 words at es:di with cs:si
+	CALL(mm1_toggle_addr+73,mm1_toggle_addr+76),     // call swap1
+	                                                 //swap1:
+	0x2E, 0x8B, 0x04,                                // mov ax, cs:[si]
+	0x26, 0x87, 0x05,                                // xchg ax, es:[di]
+	0x2E, 0x89, 0x04,                                // mov cs:[si], ax
+	0x46,                                            // inc si
+	0x46,                                            // inc si
+	0x47,                                            // inc di
+	0x47,                                            // inc di
+	0xC3,                                            // retn
+};
+// frame rate settings and the limiter
+const uint8 mm1_rate[] = {
+	// frame rate settings 1-9 (setting 0 is unlimited)
+	TIMER_RATE(60,1),                                // 60 Hz
+	TIMER_RATE(70,2),                                // 35 Hz
+	TIMER_RATE(60,2),                                // 30 Hz
+	TIMER_RATE(75,3),                                // 25 Hz
+	TIMER_RATE(70,3),                                // 23 Hz
+	TIMER_RATE(60,3),                                // 20 Hz
+	TIMER_RATE(72,4),                                // 18 Hz
+	TIMER_RATE(60,4),                                // 15 Hz
+	TIMER_RATE(60,5),                                // 12 Hz
+	// limiter variable storage (+27)
+	WORD(TIMER_DIVISOR(70)),                         // timer_divisor ; until a setting is chosen
+	0x00,                                            // timer_setting
+	WORD(0),                                         // timer_deadline
+	// setup menu label (+32)
+	0x18,0x09,10,'F','r','a','m','e','r','a','t','e',':',
+	// limiter (+45)
+	// assume: cx = frame rate setting, not 0
+	0x53,                                            // push bx
+	0x89, 0xCB,                                      // mov bx, cx
+	0xD1, 0xE3,                                      // shl bx, 1
+	0x01, 0xCB,                                      // add bx, cx
+	0x2E, 0x3A, 0x0E, WORD(mm1_rate_addr+29),        // cmp cl, cs:timer_setting
+	0x74, 36,                                        // jz ready
+	0x2E, 0x88, 0x0E, WORD(mm1_rate_addr+29),        // mov cs:timer_setting, cl
+	0x2E, 0x8B, 0x87, WORD(mm1_rate_addr-3),         // mov ax, cs:[bx+rate_table-3]
+	0x2E, 0xA3, WORD(mm1_rate_addr+27),              // mov cs:timer_divisor, ax
+	0x2E, 0x80, 0x3E, WORD(mm1_timer_addr+12), 0x00, // cmp cs:timer_installed, 0
+	0x74, 0x03,                                      // jz install
+	CALL(mm1_rate_addr+81,mm1_toggle_addr),          // call timer_toggle ; uninstall at the old rate
+	                                                 //install:
+	CALL(mm1_rate_addr+84,mm1_toggle_addr),          // call timer_toggle ; install at the new rate
+	0x2E, 0xA1, WORD(mm1_timer_addr+8),              // mov ax, cs:timer_ticks
+	0x2E, 0xA3, WORD(mm1_rate_addr+30),              // mov cs:timer_deadline, ax
+	                                                 //ready:
+	0x2E, 0x8A, 0x87, WORD(mm1_rate_addr-1),         // mov al, cs:[bx+rate_table-1] ; ticks per frame
+	0x98,                                            // cbw
+	0x2E, 0x03, 0x06, WORD(mm1_rate_addr+30),        // add ax, cs:timer_deadline
+	                                                 //check:
+	0x2E, 0x8B, 0x16, WORD(mm1_timer_addr+8),        // mov dx, cs:timer_ticks
+	0x29, 0xC2,                                      // sub dx, ax
+	0x79, 0x04,                                      // jns arrived
+	0xFB,                                            // sti
+	0xF4,                                            // hlt
+	0xEB, 0xF3,                                      // jmp check
+	                                                 //arrived:
+	0x01, 0xD0,                                      // add ax, dx ; if late, start over from the current tick
+	0x2E, 0xA3, WORD(mm1_rate_addr+30),              // mov cs:timer_deadline, ax
+	0x5B,                                            // pop bx
+	0xC3,                                            // retn
+};
+// replaces the slowdown strings at the start of mm1_table with frame rates,
+// the label moves to mm1_rate
+const uint8 mm1_table_timer[] = {
+	0x23,0x09,2,'-','-',
+	0x26,0x09,2,'6','0',
+	0x29,0x09,2,'3','5',
+	0x2C,0x09,2,'3','0',
+	0x2F,0x09,2,'2','5',
+	0x32,0x09,2,'2','3',
+	0x35,0x09,2,'2','0',
+	0x38,0x09,2,'1','8',
+	0x3B,0x09,2,'1','5',
+	0x3E,0x09,2,'1','2',
+	0,0,
+	timer_default, 9,
+	WORD(mm1_rate_addr+32),
+	WORD(mm1_table_addr+(5*0)),
+	WORD(mm1_table_addr+(5*1)),
+	WORD(mm1_table_addr+(5*2)),
+	WORD(mm1_table_addr+(5*3)),
+	WORD(mm1_table_addr+(5*4)),
+	WORD(mm1_table_addr+(5*5)),
+	WORD(mm1_table_addr+(5*6)),
+	WORD(mm1_table_addr+(5*7)),
+	WORD(mm1_table_addr+(5*8)),
+	WORD(mm1_table_addr+(5*9)),
+};
+// with -timer the filtered poll idles until the next timer interrupt first
+const uint8 mm1_select_timer[] = { CALL(mm1_select_addr+1,mm1_slow_addr+23) };
+
+const patch mm1_timer_patch[] =
+{
+	{ mm1_slow_file, LENGTH(mm1_slow_timer), mm1_slow_timer },
+	{ mm1_table_file, LENGTH(mm1_table_timer), mm1_table_timer },
+	{ mm1_toggle_file, LENGTH(mm1_toggle), mm1_toggle },
+	{ mm1_select_file+1, LENGTH(mm1_select_timer), mm1_select_timer },
+	{ mm1_timer_file, LENGTH(mm1_timer), mm1_timer },
+	{ mm1_rate_file, LENGTH(mm1_rate), mm1_rate },
+	{0,0,NULL}
+};
+
+// optional frame time telemetry (-telemetry)
+// The slowdown call in the game loop goes through a routine that timestamps each frame from the
+// BIOS tick count and PIT channel 0, and keeps the time of the last FRAMES_RING frames, and of the
+// slowdown within them, in a ring buffer. INT 21h is hooked on the first frame to write the buffer
+// to FRAMES_FILE when the game exits, for MMPATCH -analyze to report on.
+// Times are kept in bytes in units of 512 PIT clocks (0.43 ms), and 255 means 109 ms or more.
+// The 8254 read-back command is used to tell which half of the BIOS square wave channel 0 is in,
+// so this needs an AT or later. It shares the dead Tandy code with -timer and -adaptive, and can't
+// be combined with either.
+
+// after the joystick routine, after the settings finalization, after the select filter,
+// and after the robot master screen wait
+#define mm1_frame_addr      0x2488
+#define mm1_hook_addr       0x22AE
+#define mm1_clock_addr      0x2521
+#define mm1_frames_addr     0x25B9
+#define mm1_frame_file      0x1CF6
+#define mm1_hook_file       0x1B1C
+#define mm1_clock_file      0x1D8F
+#define mm1_frames_file     0x1E27
+
+#define FRAMES_FILE     "MMFRAMES.DAT"
+#define FRAMES_RING     64                     // frames kept, a power of 2 no more than 64
+#define FRAMES_SIZE     (8+(2*FRAMES_RING))    // telemetry written, including its header
+#define FRAMES_UNIT     512                    // PIT clocks per unit of time
+
+#define mm1_exit_addr   (mm1_frames_addr+FRAMES_SIZE)
+#define mm1_exit_file   (mm1_frames_file+FRAMES_SIZE)
+
+// replaces the slowdown call in the game loop
+const uint8 mm1_slow0_frames[] = { CALL(mm1_slow0_addr,mm1_frame_addr), 0x90, 0x90, 0x90 };
+// times the frame since the last one, and the slowdown
+const uint8 mm1_frame[] = {
+	0x50,                                            // push ax
+	0x53,                                            // push bx
+	0x51,                                            // push cx
+	0x2E, 0x83, 0x3E, WORD(mm1_frame_addr+87), 0x00, // cmp cs:old_int21+2, 0
+	0x75, 0x08,                                      // jnz installed
+	0x2E, 0x8C, 0x0E, WORD(mm1_frame_addr+87),       // mov cs:old_int21+2, cs
+	CALL(mm1_frame_addr+16,mm1_hook_addr),           // call frames_hook ; install
+	                                                 //installed:
+	CALL(mm1_frame_addr+19,mm1_clock_addr),          // call frames_clock
+	0x89, 0xC1,                                      // mov cx, ax
+	0x2E, 0x87, 0x06, WORD(mm1_frames_addr+6),       // xchg ax, cs:frames_last
+	0xF7, 0xD8,                                      // neg ax
+	0x01, 0xC8,                                      // add ax, cx ; frame time
+	0x50,                                            // push ax
+	CALL(mm1_frame_addr+34,mm1_slow_addr),           // call slowdown
+	0x5B,                                            // pop bx
+	0x9C,                                            // pushf ; keep the joystick enabled result
+	CALL(mm1_frame_addr+39,mm1_clock_addr),          // call frames_clock
+	0x29, 0xC8,                                      // sub ax, cx ; slowdown time
+	0x08, 0xE4,                                      // or ah, ah
+	0x74, 0x02,                                      // jz +2
+	0xB0, 0xFF,                                      // mov al, 255
+	0x08, 0xFF,                                      // or bh, bh
+	0x74, 0x02,                                      // jz +2
+	0xB3, 0xFF,                                      // mov bl, 255
+	0x88, 0xC4,                                      // mov ah, al
+	0x88, 0xD8,                                      // mov al, bl
+	0x2E, 0x8B, 0x1E, WORD(mm1_frames_addr+4),       // mov bx, cs:frames_count
+	0x83, 0xE3, FRAMES_RING-1,                       // and bx, FRAMES_RING-1
+	0xD1, 0xE3,                                      // shl bx, 1
+	0x2E, 0x89, 0x87, WORD(mm1_frames_addr+8),       // mov cs:[bx+frames_ring], ax
+	0x2E, 0xFF, 0x06, WORD(mm1_frames_addr+4),       // inc cs:frames_count
+	0x9D,                                            // popf
+	0x59,                                            // pop cx
+	0x5B,                                            // pop bx
+	0x58,                                            // pop ax
+	0xC3,                                            // retn
+	// INT 21h vector, swapped with the interrupt table by frames_hook (+85)
+	WORD(mm1_exit_addr), WORD(0),                    // old_int21
+	// telemetry filename (+89)
+	'M','M','F','R','A','M','E','S','.','D','A','T',0,
+};
+// returns ax = time in units of 512 PIT clocks, from the BIOS tick count and PIT channel 0
+const uint8 mm1_clock[] = {
+	0x53,                     // push bx
+	0x52,                     // push dx
+	0x1E,                     // push ds
+	0x9C,                     // pushf
+	0xFA,                     // cli
+	0xB0, 0xC2,               // mov al, C2h ; read back channel 0 status and count
+	0xE6, 0x43,               // out 43h, al
+	0xE4, 0x40,               // in al, 40h
+	0x88, 0xC2,               // mov dl, al ; status
+	0xE4, 0x40,               // in al, 40h
+	0x88, 0xC4,               // mov ah, al
+	0xE4, 0x40,               // in al, 40h
+	0x86, 0xE0,               // xchg al, ah ; count, by 2 in each half of the square wave
+	0xF7, 0xD8,               // neg ax
+	0xD1, 0xE8,               // shr ax, 1 ; clocks into this half
+	0xF6, 0xC2, 0x80,         // test dl, 80h ; output is high in the first half
+	0x75, 0x03,               // jnz first
+	0x80, 0xCC, 0x80,         // or ah, 80h
+	                          //first:
+	0x89, 0xC3,               // mov bx, ax ; clocks into this tick
+	0xB0, 0x0A,               // mov al, 0Ah
+	0xE6, 0x20,               // out 20h, al ; read interrupt requests
+	0xE4, 0x20,               // in al, 20h
+	0x31, 0xD2,               // xor dx, dx
+	0x8E, 0xDA,               // mov ds, dx
+	0x8B, 0x16, WORD(0x046C), // mov dx, ds:046Ch ; BIOS tick count
+	0xF6, 0xC7, 0x80,         // test bh, 80h
+	0x75, 0x05,               // jnz ready
+	0xD0, 0xE8,               // shr al, 1
+	0x83, 0xD2, 0x00,         // adc dx, 0 ; a tick that has started but not yet been counted
+	                          //ready:
+	0x88, 0xD4,               // mov ah, dl
+	0x88, 0xF8,               // mov al, bh
+	0xD0, 0xEE,               // shr dh, 1
+	0xD1, 0xD8,               // rcr ax, 1 ; ticks:clocks / 512
+	0x9D,                     // popf
+	0x1F,                     // pop ds
+	0x5A,                     // pop dx
+	0x5B,                     // pop bx
+	0xC3,                     // retn
+};
+// installs or uninstalls the INT 21h handler
+const uint8 mm1_hook[] = {
+	0x9C,                                // pushf
+	0x50,                                // push ax
+	0x06,                                // push es
+	0xFA,                                // cli
+	0x31, 0xC0,                          // xor ax, ax
+	0x8E, 0xC0,                          // mov es, ax
+	0x2E, 0xA1, WORD(mm1_frame_addr+85), // mov ax, cs:old_int21
+	0x26, 0x87, 0x06, WORD(0x0084),      // xchg ax, es:0084h ; INT 21h vector
+	0x2E, 0xA3, WORD(mm1_frame_addr+85), // mov cs:old_int21, ax
+	0x2E, 0xA1, WORD(mm1_frame_addr+87), // mov ax, cs:old_int21+2
+	0x26, 0x87, 0x06, WORD(0x0086),      // xchg ax, es:0086h
+	0x2E, 0xA3, WORD(mm1_frame_addr+87), // mov cs:old_int21+2, ax
+	0x07,                                // pop es
+	0x58,                                // pop ax
+	0x9D,                                // popf
+	0xC3,                                // retn
+};
+// telemetry header, the ring buffer follows
+const uint8 mm1_frames[] = {
+	'M','M','F',1, // signature and version
+	WORD(0),       // frames_count
+	WORD(0),       // frames_last ; clock at the start of the last frame
+};
+// INT 21h handler, writes the telemetry when the game exits
+const uint8 mm1_exit[] = {
+	0x80, 0xFC, 0x4C,                          // cmp ah, 4Ch ; terminate
+	0x74, 0x0C,                                // jz exit
+	0x08, 0xE4,                                // or ah, ah ; terminate (old)
+	0x74, 0x05,                                // jz old
+	0x2E, 0xFF, 0x2E, WORD(mm1_frame_addr+85), // jmp far cs:old_int21
+	                                           //old:
+	0xB8, WORD(0x4C00),                        // mov ax, 4C00h ; 00h would take the PSP from our CS
+	                                           //exit:
+	CALL(mm1_exit_addr+17,mm1_hook_addr),      // call frames_hook ; uninstall
+	0x50,                                      // push ax
+	0x0E,                                      // push cs
+	0x1F,                                      // pop ds
+	0xB4, 0x3C,                                // mov ah, 3Ch ; create
+	0x31, 0xC9,                                // xor cx, cx
+	0xBA, WORD(mm1_frame_addr+89),             // mov dx, frames_filename
+	0xCD, 0x21,                                // int 21h
+	0x72, 0x0A,                                // jc fail
+	0x93,                                      // xchg bx, ax
+	0xB4, 0x40,                                // mov ah, 40h ; write
+	0xB1, FRAMES_SIZE,                         // mov cl, FRAMES_SIZE
+	0xBA, WORD(mm1_frames_addr),               // mov dx, frames
+	0xCD, 0x21,                                // int 21h ; terminating closes the file
+	                                           //fail:
+	0x58,                                      // pop ax
+	0xCD, 0x21,                                // int 21h ; terminate with the restored vector
+};
+
+const patch mm1_telemetry_patch[] =
+{
+	{ mm1_hook_file, LENGTH(mm1_hook), mm1_hook },
+	{ mm1_frame_file, LENGTH(mm1_frame), mm1_frame },
+	{ mm1_clock_file, LENGTH(mm1_clock), mm1_clock },
+	{ mm1_frames_file, LENGTH(mm1_frames), mm1_frames },
+	{ mm1_exit_file, LENGTH(mm1_exit), mm1_exit },
+	{ mm1_slow0_file, LENGTH(mm1_slow0_frames), mm1_slow0_frames },
+	{0,0,NULL}
+};
+
+// optional adaptive slowdown (-adaptive)
+// The slowdown waits for a number of video frames after each pass of the game loop, so the time the
+// game itself takes is added on top, and a heavy scene runs a frame slower than the setting.
+// Instead the game loop's slowdown call goes through a routine that measures the video frame once
+// with the mm1_clock timer, and subtracts the whole frames that have passed since the last wait
+// from the setting, waiting for none if the game is already behind.
+// This shares mm1_clock and the dead Tandy code with -telemetry, and can't be combined with it
+// or with -timer.
+
+// the same space as mm1_frame
+#define mm1_adapt_addr      0x2488
+#define mm1_adapt_file      0x1CF6
+
+// replaces the slowdown call in the game loop
+const uint8 mm1_slow0_adapt[] = { CALL(mm1_slow0_addr,mm1_adapt_addr), 0x90, 0x90, 0x90 };
+// waits for the rest of the frames in the speed setting
+const uint8 mm1_adapt[] = {
+	0x50,                                            // push ax
+	0x51,                                            // push cx
+	0x52,                                            // push dx
+	0x2E, 0x83, 0x3E, WORD(mm1_adapt_addr+86), 0x00, // cmp cs:adapt_refresh, 0
+	0x75, 0x1A,                                      // jnz ready
+	0xB9, WORD(1),                                   // mov cx, 1 ; time one video frame
+	CALL(mm1_adapt_addr+14,mm1_adapt_addr+79),       // call adapt_wait
+	CALL(mm1_adapt_addr+17,mm1_clock_addr),          // call frames_clock
+	0xF7, 0xD8,                                      // neg ax
+	0x2E, 0xA3, WORD(mm1_adapt_addr+86),             // mov cs:adapt_refresh, ax
+	CALL(mm1_adapt_addr+26,mm1_adapt_addr+79),       // call adapt_wait
+	CALL(mm1_adapt_addr+29,mm1_clock_addr),          // call frames_clock
+	0x2E, 0x01, 0x06, WORD(mm1_adapt_addr+86),       // add cs:adapt_refresh, ax
+	                                                 //ready:
+	CALL(mm1_adapt_addr+37,mm1_clock_addr),          // call frames_clock
+	0x2E, 0x2B, 0x06, WORD(mm1_adapt_addr+88),       // sub ax, cs:adapt_last ; time since the last wait
+	0x31, 0xD2,                                      // xor dx, dx
+	0x2E, 0xF7, 0x36, WORD(mm1_adapt_addr+86),       // div cs:adapt_refresh ; whole frames
+	0x2E, 0x8B, 0x0E, WORD(mm1_slow_addr+5),         // mov cx, cs:speed
+	0x29, 0xC1,                                      // sub cx, ax
+	0x73, 0x02,                                      // jnc wait
+	0x31, 0xC9,                                      // xor cx, cx ; already behind
+	                                                 //wait:
+	CALL(mm1_adapt_addr+63,mm1_adapt_addr+79),       // call adapt_wait
+	0x9C,                                            // pushf ; keep the joystick enabled result
+	CALL(mm1_adapt_addr+67,mm1_clock_addr),          // call frames_clock
+	0x2E, 0xA3, WORD(mm1_adapt_addr+88),             // mov cs:adapt_last, ax
+	0x9D,                                            // popf
+	0x5A,                                            // pop dx
+	0x59,                                            // pop cx
+	0x58,                                            // pop ax
+	0xC3,                                            // retn
+	// waits cx frames in the slowdown routine (+79)
+	0x9C,                                            // pushf
+	0x50,                                            // push ax
+	0x51,                                            // push cx
+	0x52,                                            // push dx
+	JMP(mm1_adapt_addr+83,mm1_slow_addr+7),          // jmp slowdown cx frames
+	// adaptive variable storage (+86)
+	WORD(0),                                         // adapt_refresh ; clock time of one video frame
+	WORD(0),                                         // adapt_last ; clock at the end of the last wait
+};
+
+const patch mm1_adaptive_patch[] =
+{
+	{ mm1_adapt_file, LENGTH(mm1_adapt), mm1_adapt },
+	{ mm1_clock_file, LENGTH(mm1_clock), mm1_clock },
+	{ mm1_slow0_file, LENGTH(mm1_slow0_adapt), mm1_slow0_adapt },
+	{0,0,NULL}
+};
+
 // patch set
 const patch mm1_patch[] =
 {
@@ -498,6 +1097,37 @@ const patch mm1_patch[] =
 	{0,0,NULL}
 };
 
+// fingerprint: original bytes at some of the patched sites, in file order
+const uint8 mm1_joy1_original[]     = { 0x88, 0x1E, WORD(0x114A) };             // mov joy_centre_x, bl
+const uint8 mm1_table0_original[]   = { WORD(0x110D) };
+const uint8 mm1_table1_original[]   = { WORD(0x113D) };
+const uint8 mm1_settings0_original[] = { 0x2E, 0x80, 0x3E, WORD(0x114C), 0x01 }; // cmp cs:114Ch, 1
+const uint8 mm1_slow0_original[]    = { 0x2E, 0x80, 0x3E, WORD(0x1149), 0x00 }; // cmp cs:1149h, 0
+const patch mm1_fingerprint[] =
+{
+	{ 0, 2, mz },
+	{ mm1_joy1_file, LENGTH(mm1_joy1_original), mm1_joy1_original },
+	{ 0x47DB, 2, mm1_table0_original },
+	{ 0x4820, 1, five },
+	{ 0x487D, 1, five },
+	{ 0x489C, 2, mm1_table1_original },
+	{ 0x48BB, 2, mm1_table1_original },
+	{ 0x490D, 1, five },
+	{ mm1_settings0_file, LENGTH(mm1_settings0_original), mm1_settings0_original },
+	{ mm1_slow0_file, LENGTH(mm1_slow0_original), mm1_slow0_original },
+	{0,0,NULL}
+};
+// more original bytes for -scan, the other input polls found by the same search as mm1_slow0
+const patch mm1_signature[] =
+{
+	{ mm1_poll0_file, LENGTH(mm1_slow0_original), mm1_slow0_original },
+	{ mm1_poll1_file, LENGTH(mm1_slow0_original), mm1_slow0_original },
+	{ mm1_poll2_file, LENGTH(mm1_slow0_original), mm1_slow0_original },
+	{ mm1_poll3_file, LENGTH(mm1_slow0_original), mm1_slow0_original },
+	{ mm1_poll4_file, LENGTH(mm1_slow0_original), mm1_slow0_original },
+	{0,0,NULL}
+};
+
 //
 // Mega Man 3 patch
 //
@@ -551,21 +1181,21 @@ const uint8 mm3_slow[] = {
 #define mm3_slow0_addr   0xD7FD
 #define mm3_slow0_file   0x8ADA
 const uint8 mm3_slow0[] = { CALL(mm3_slow0_addr,mm3_slow_addr), 0x90, 0x90 };
-// only the main game loop is patched, but several other input poll candidates were found,
+// only the main game loop is patched by default, but several other input poll candidates were found,
 // searching for uses of cs:505Bh which is the joystick setting flag:
 // address (file offset)
-// CE7Ch (8159)
+// CE7Ch (8159) - wait screen, -poll vsync
 // D061h (833E) - followed by calibration rather than poll
-// D25Bh (8538)
+// D25Bh (8538) - stage select, -poll full
 // D2C7h (85A4) - not followed by a poll
-// D38Eh (866B)
+// D38Eh (866B) - wait screen, -poll vsync
 // D595h (8872) - setup menu initialization setting
 // D5A1h (8873) - setup menu initialization setting
 // D6CDh (88AA) - followed by calibration rather than poll
-// D6EDh (89CA)
-// D722h (89FF)
-// D757h (8A34)
-// D85Dh (8B3A)
+// D6EDh (89CA) - wait screen, -poll vsync
+// D722h (89FF) - wait screen, -poll vsync
+// D757h (8A34) - wait screen, -poll vsync
+// D85Dh (8B3A) - wait screen, -poll vsync
 
 const uint8 mm3_table[] = {
 	// table of strings for the slowdown setting
@@ -709,6 +1339,506 @@ const uint8 mm3_select4[] = { CALL(mm3_select4_addr, mm3_select_addr+1) };
 const uint8 mm3_select5[] = { CALL(mm3_select5_addr, mm3_select_addr+1) };
 const uint8 mm3_select6[] = { CALL(mm3_select6_addr, mm3_select_addr+1) };
 
+// optional pacing of the other input polls (-poll), see the Mega Man 1 patch above
+
+#define mm3_vsync_addr   (mm3_slow_addr+40)
+#define mm3_vsync_file   (mm3_slow_file+40)
+const uint8 mm3_vsync[] = {
+	0x9C,                                  // pushf
+	0x50,                                  // push ax
+	0x51,                                  // push cx
+	0x52,                                  // push dx
+	0xB9, WORD(1),                         // mov cx, 1
+	JMP(mm3_vsync_addr+7,mm3_slow_addr+7), // jmp slowdown ; continues at jcxz end
+};
+// replacing "cmp ds:505Bh, 0" with a call, as mm3_slow0 does
+#define mm3_poll0_addr   0xCE7C
+#define mm3_poll1_addr   0xD25B
+#define mm3_poll2_addr   0xD38E
+#define mm3_poll3_addr   0xD6ED
+#define mm3_poll4_addr   0xD722
+#define mm3_poll5_addr   0xD757
+#define mm3_poll6_addr   0xD85D
+#define mm3_poll0_file   0x8159
+#define mm3_poll1_file   0x8538
+#define mm3_poll2_file   0x866B
+#define mm3_poll3_file   0x89CA
+#define mm3_poll4_file   0x89FF
+#define mm3_poll5_file   0x8A34
+#define mm3_poll6_file   0x8B3A
+const uint8 mm3_poll0[] = { CALL(mm3_poll0_addr, mm3_vsync_addr), 0x90, 0x90 };
+const uint8 mm3_poll1[] = { CALL(mm3_poll1_addr, mm3_slow_addr), 0x90, 0x90 }; // stage select
+const uint8 mm3_poll2[] = { CALL(mm3_poll2_addr, mm3_vsync_addr), 0x90, 0x90 };
+const uint8 mm3_poll3[] = { CALL(mm3_poll3_addr, mm3_vsync_addr), 0x90, 0x90 };
+const uint8 mm3_poll4[] = { CALL(mm3_poll4_addr, mm3_vsync_addr), 0x90, 0x90 };
+const uint8 mm3_poll5[] = { CALL(mm3_poll5_addr, mm3_vsync_addr), 0x90, 0x90 };
+const uint8 mm3_poll6[] = { CALL(mm3_poll6_addr, mm3_vsync_addr), 0x90, 0x90 };
+
+const patch mm3_poll_patch[] =
+{
+	{ mm3_vsync_file, LENGTH(mm3_vsync), mm3_vsync },
+	{ mm3_poll0_file, LENGTH(mm3_poll0), mm3_poll0 },
+	{ mm3_poll1_file, LENGTH(mm3_poll1), mm3_poll1 },
+	{ mm3_poll2_file, LENGTH(mm3_poll2), mm3_poll2 },
+	{ mm3_poll3_file, LENGTH(mm3_poll3), mm3_poll3 },
+	{ mm3_poll4_file, LENGTH(mm3_poll4), mm3_poll4 },
+	{ mm3_poll5_file, LENGTH(mm3_poll5), mm3_poll5 },
+	{ mm3_poll6_file, LENGTH(mm3_poll6), mm3_poll6 },
+	{0,0,NULL}
+};
+
+// optional timer slowdown (-timer), see the Mega Man 1 patch above
+
+// the same dead Tandy code as above, in the unused space after the earlier patches
+#define mm3_timer_addr      0x6D78
+#define mm3_toggle_addr     0x6E18
+#define mm3_rate_addr       0x6EB0
+#define mm3_timer_file      0x21E7
+#define mm3_toggle_file     0x2287
+#define mm3_rate_file       0x231F
+
+// replaces mm3_slow, keeping its frame rate setting at +5
+const uint8 mm3_slow_timer[] = {
+	0x9C,                                            // pushf
+	0x50,                                            // push ax
+	0x51,                                            // push cx
+	0x52,                                            // push dx
+	0xB9, timer_default, 0x00,                       // mov cx, setting
+	0xE3, 0x03,                                      // jcxz end
+	CALL(mm3_slow_addr+9,mm3_rate_addr+45),          // call timer_limit
+	                                                 //end:
+	0x5A,                                            // pop dx
+	0x59,                                            // pop cx
+	0x58,                                            // pop ax
+	0x9D,                                            // popf
+	0x80, 0x3E, WORD(0x505B), 0x00,                  // cmp ds:505Bh, 0 ; joystick enabled
+	0xC3,                                            // retn
+	// idle until the next timer interrupt before a joystick poll (+22)
+	0x9C,                                            // pushf
+	0x2E, 0x80, 0x3E, WORD(mm3_timer_addr+12), 0x00, // cmp cs:timer_installed, 0
+	0x75, 0x03,                                      // jnz ready
+	CALL(mm3_slow_addr+31,mm3_toggle_addr),          // call timer_toggle
+	                                                 //ready:
+	0xFB,                                            // sti
+	0xF4,                                            // hlt
+	0x9D,                                            // popf
+	JMP(mm3_slow_addr+37,0x6046),                    // jmp joystick poll
+	// replaces mm3_vsync for -poll sites (+40)
+	0x9C,                                            // pushf
+	0x2E, 0x80, 0x3E, WORD(mm3_timer_addr+12), 0x00, // cmp cs:timer_installed, 0
+	0x75, 0x03,                                      // jnz ready
+	CALL(mm3_slow_addr+49,mm3_toggle_addr),          // call timer_toggle
+	                                                 //ready:
+	0xFB,                                            // sti
+	0xF4,                                            // hlt
+	0x9D,                                            // popf
+	0x80, 0x3E, WORD(0x505B), 0x00,                  // cmp ds:505Bh, 0 ; joystick enabled
+	0xC3,                                            // retn
+};
+// timer variables and interrupt handlers
+const uint8 mm3_timer[] = {
+	// timer variable storage, the vectors are swapped with the interrupt table by timer_toggle
+	WORD(mm3_timer_addr+13), WORD(0),          // old_int8
+	WORD(mm3_timer_addr+42), WORD(0),          // old_int21
+	WORD(0),                                   // timer_ticks
+	WORD(0),                                   // timer_chain
+	0x00,                                      // timer_installed
+	// INT 8 handler (+13)
+	0x50,                                      // push ax
+	0x2E, 0xFF, 0x06, WORD(mm3_timer_addr+8),  // inc cs:timer_ticks
+	0x2E, 0xA1, WORD(mm3_rate_addr+27),        // mov ax, cs:timer_divisor
+	0x2E, 0x01, 0x06, WORD(mm3_timer_addr+10), // add cs:timer_chain, ax ; carry every 65536 PIT clocks
+	0x72, 0x06,                                // jc chain
+	0xB0, 0x20,                                // mov al, 20h
+	0xE6, 0x20,                                // out 20h, al ; end of interrupt
+	0x58,                                      // pop ax
+	0xCF,                                      // iret
+	                                           //chain:
+	0x58,                                      // pop ax
+	0x2E, 0xFF, 0x2E, WORD(mm3_timer_addr+0),  // jmp far cs:old_int8 ; sends its own end of interrupt
+	// INT 21h handler (+42)
+	0x80, 0xFC, 0x4C,                          // cmp ah, 4Ch ; terminate
+	0x74, 0x0C,                                // jz exit
+	0x08, 0xE4,                                // or ah, ah ; terminate (old)
+	0x74, 0x05,                                // jz old
+	0x2E, 0xFF, 0x2E, WORD(mm3_timer_addr+4),  // jmp far cs:old_int21
+	                                           //old:
+	0xB8, WORD(0x4C00),                        // mov ax, 4C00h ; 00h would take the PSP from our CS
+	                                           //exit:
+	CALL(mm3_timer_addr+59,mm3_toggle_addr),   // call timer_toggle ; uninstall
+	0xCD, 0x21,                                // int 21h ; terminate with the restored vector
+};
+// installs or uninstalls the timer
+const uint8 mm3_toggle[] = {
+	0x9C,                                            // pushf
+	0x50,                                            // push ax
+	0x56,                                            // push si
+	0x57,                                            // push di
+	0x06,                                            // push es
+	0xFA,                                            // cli
+	0x2E, 0x80, 0x3E, WORD(mm3_timer_addr+12), 0x00, // cmp cs:timer_installed, 0
+	0x75, 0x0A,                                      // jnz swap
+	0x2E, 0x8C, 0x0E, WORD(mm3_timer_addr+2),        // mov cs:old_int8+2, cs ; our vectors until swapped
+	0x2E, 0x8C, 0x0E, WORD(mm3_timer_addr+6),        // mov cs:old_int21+2, cs
+	                                                 //swap:
+	0x31, 0xC0,                                      // xor ax, ax
+	0x8E, 0xC0,                                      // mov es, ax
+	0xBF, WORD(0x0020),                              // mov di, 0020h ; INT 8 vector
+	0xBE, WORD(mm3_timer_addr+0),                    // mov si, old_int8
+	CALL(mm3_toggle_addr+34,mm3_toggle_addr+73),     // call swap2
+	0xBF, WORD(0x0084),                              // mov di, 0084h ; INT 21h vector
+	CALL(mm3_toggle_addr+40,mm3_toggle_addr+73),     // call swap2
+	0xB0, 0x36,                                      // mov al, 36h ; channel 0, low/high byte, mode 3
+	0xE6, 0x43,                                      // out 43h, al
+	0x2E, 0x80, 0x36, WORD(mm3_timer_addr+12), 0x01, // xor cs:timer_installed, 1
+	0x2E, 0xA1, WORD(mm3_rate_addr+27),              // mov ax, cs:timer_divisor
+	0x75, 0x02,                                      // jnz +2
+	0x31, 0xC0,                                      // xor ax, ax ; 65536 is the BIOS default
+	0xE6, 0x40,                                      // out 40h, al
+	0x88, 0xE0,                                      // mov al, ah
+	0xE6, 0x40,                                      // out 40h, al
+	0x07,                                            // pop es
+	0x5F,                                            // pop di
+	0x5E,                                            // pop si
+	0x58,                                            // pop ax
+	0x9D,                                            // popf
+	0xC3,                                            // retn
+	                                                 //swap2: ; exchanges 2 words at es:di with cs:si
+	CALL(mm3_toggle_addr+73,mm3_toggle_addr+76),     // call swap1
+	                                                 //swap1:
+	0x2E, 0x8B, 0x04,                                // mov ax, cs:[si]
+	0x26, 0x87, 0x05,                                // xchg ax, es:[di]
+	0x2E, 0x89, 0x04,                                // mov cs:[si], ax
+	0x46,                                            // inc si
+	0x46,                                            // inc si
+	0x47,                                            // inc di
+	0x47,                                            // inc di
+	0xC3,                                            // retn
+};
+// frame rate settings and the limiter
+const uint8 mm3_rate[] = {
+	// frame rate settings 1-9 (setting 0 is unlimited)
+	TIMER_RATE(60,1),                                // 60 Hz
+	TIMER_RATE(70,2),                                // 35 Hz
+	TIMER_RATE(60,2),                                // 30 Hz
+	TIMER_RATE(75,3),                                // 25 Hz
+	TIMER_RATE(70,3),                                // 23 Hz
+	TIMER_RATE(60,3),                                // 20 Hz
+	TIMER_RATE(72,4),                                // 18 Hz
+	TIMER_RATE(60,4),                                // 15 Hz
+	TIMER_RATE(60,5),                                // 12 Hz
+	// limiter variable storage (+27)
+	WORD(TIMER_DIVISOR(70)),                         // timer_divisor ; until a setting is chosen
+	0x00,                                            // timer_setting
+	WORD(0),                                         // timer_deadline
+	// setup menu label (+32)
+	0x18,0x09,10,'F','r','a','m','e','r','a','t','e',':',
+	// limiter (+45)
+	// assume: cx = frame rate setting, not 0
+	0x53,                                            // push bx
+	0x89, 0xCB,                                      // mov bx, cx
+	0xD1, 0xE3,                                      // shl bx, 1
+	0x01, 0xCB,                                      // add bx, cx
+	0x2E, 0x3A, 0x0E, WORD(mm3_rate_addr+29),        // cmp cl, cs:timer_setting
+	0x74, 36,                                        // jz ready
+	0x2E, 0x88, 0x0E, WORD(mm3_rate_addr+29),        // mov cs:timer_setting, cl
+	0x2E, 0x8B, 0x87, WORD(mm3_rate_addr-3),         // mov ax, cs:[bx+rate_table-3]
+	0x2E, 0xA3, WORD(mm3_rate_addr+27),              // mov cs:timer_divisor, ax
+	0x2E, 0x80, 0x3E, WORD(mm3_timer_addr+12), 0x00, // cmp cs:timer_installed, 0
+	0x74, 0x03,                                      // jz install
+	CALL(mm3_rate_addr+81,mm3_toggle_addr),          // call timer_toggle ; uninstall at the old rate
+	                                                 //install:
+	CALL(mm3_rate_addr+84,mm3_toggle_addr),          // call timer_toggle ; install at the new rate
+	0x2E, 0xA1, WORD(mm3_timer_addr+8),              // mov ax, cs:timer_ticks
+	0x2E, 0xA3, WORD(mm3_rate_addr+30),              // mov cs:timer_deadline, ax
+	                                                 //ready:
+	0x2E, 0x8A, 0x87, WORD(mm3_rate_addr-1),         // mov al, cs:[bx+rate_table-1] ; ticks per frame
+	0x98,                                            // cbw
+	0x2E, 0x03, 0x06, WORD(mm3_rate_addr+30),        // add ax, cs:timer_deadline
+	                                                 //check:
+	0x2E, 0x8B, 0x16, WORD(mm3_timer_addr+8),        // mov dx, cs:timer_ticks
+	0x29, 0xC2,                                      // sub dx, ax
+	0x79, 0x04,                                      // jns arrived
+	0xFB,                                            // sti
+	0xF4,                                            // hlt
+	0xEB, 0xF3,                                      // jmp check
+	                                                 //arrived:
+	0x01, 0xD0,                                      // add ax, dx ; if late, start over from the current tick
+	0x2E, 0xA3, WORD(mm3_rate_addr+30),              // mov cs:timer_deadline, ax
+	0x5B,                                            // pop bx
+	0xC3,                                            // retn
+};
+// replaces the slowdown strings at the start of mm3_table with frame rates,
+// the label moves to mm3_rate
+const uint8 mm3_table_timer[] = {
+	0x23,0x09,2,'-','-',
+	0x26,0x09,2,'6','0',
+	0x29,0x09,2,'3','5',
+	0x2C,0x09,2,'3','0',
+	0x2F,0x09,2,'2','5',
+	0x32,0x09,2,'2','3',
+	0x35,0x09,2,'2','0',
+	0x38,0x09,2,'1','8',
+	0x3B,0x09,2,'1','5',
+	0x3E,0x09,2,'1','2',
+	0,0,
+	timer_default, 9,
+	WORD(mm3_rate_addr+32),
+	WORD(mm3_table_addr+(5*0)),
+	WORD(mm3_table_addr+(5*1)),
+	WORD(mm3_table_addr+(5*2)),
+	WORD(mm3_table_addr+(5*3)),
+	WORD(mm3_table_addr+(5*4)),
+	WORD(mm3_table_addr+(5*5)),
+	WORD(mm3_table_addr+(5*6)),
+	WORD(mm3_table_addr+(5*7)),
+	WORD(mm3_table_addr+(5*8)),
+	WORD(mm3_table_addr+(5*9)),
+};
+// with -timer the filtered poll idles until the next timer interrupt first
+const uint8 mm3_select_timer[] = { CALL(mm3_select_addr+1,mm3_slow_addr+22) };
+
+const patch mm3_timer_patch[] =
+{
+	{ mm3_slow_file, LENGTH(mm3_slow_timer), mm3_slow_timer },
+	{ mm3_table_file, LENGTH(mm3_table_timer), mm3_table_timer },
+	{ mm3_timer_file, LENGTH(mm3_timer), mm3_timer },
+	{ mm3_toggle_file, LENGTH(mm3_toggle), mm3_toggle },
+	{ mm3_select_file+1, LENGTH(mm3_select_timer), mm3_select_timer },
+	{ mm3_rate_file, LENGTH(mm3_rate), mm3_rate },
+	{0,0,NULL}
+};
+
+// optional frame time telemetry (-telemetry), see mm1_frame
+
+// after the settings finalization, after the settings table, and after the select filter
+#define mm3_frame_addr      0x6E14
+#define mm3_clock_addr      0x6D75
+#define mm3_frames_addr     0x6EAF
+#define mm3_hook_addr       (mm3_frames_addr+FRAMES_SIZE+48)
+#define mm3_frame_file      0x2283
+#define mm3_clock_file      0x21E4
+#define mm3_frames_file     0x231E
+#define mm3_hook_file       (mm3_frames_file+FRAMES_SIZE+48)
+
+#define mm3_exit_addr   (mm3_frames_addr+FRAMES_SIZE)
+#define mm3_exit_file   (mm3_frames_file+FRAMES_SIZE)
+
+// replaces the slowdown call in the game loop
+const uint8 mm3_slow0_frames[] = { CALL(mm3_slow0_addr,mm3_frame_addr), 0x90, 0x90 };
+// times the frame since the last one, and the slowdown
+const uint8 mm3_frame[] = {
+	0x50,                                            // push ax
+	0x53,                                            // push bx
+	0x51,                                            // push cx
+	0x2E, 0x83, 0x3E, WORD(mm3_frame_addr+87), 0x00, // cmp cs:old_int21+2, 0
+	0x75, 0x08,                                      // jnz installed
+	0x2E, 0x8C, 0x0E, WORD(mm3_frame_addr+87),       // mov cs:old_int21+2, cs
+	CALL(mm3_frame_addr+16,mm3_hook_addr),           // call frames_hook ; install
+	                                                 //installed:
+	CALL(mm3_frame_addr+19,mm3_clock_addr),          // call frames_clock
+	0x89, 0xC1,                                      // mov cx, ax
+	0x2E, 0x87, 0x06, WORD(mm3_frames_addr+6),       // xchg ax, cs:frames_last
+	0xF7, 0xD8,                                      // neg ax
+	0x01, 0xC8,                                      // add ax, cx ; frame time
+	0x50,                                            // push ax
+	CALL(mm3_frame_addr+34,mm3_slow_addr),           // call slowdown
+	0x5B,                                            // pop bx
+	0x9C,                                            // pushf ; keep the joystick enabled result
+	CALL(mm3_frame_addr+39,mm3_clock_addr),          // call frames_clock
+	0x29, 0xC8,                                      // sub ax, cx ; slowdown time
+	0x08, 0xE4,                                      // or ah, ah
+	0x74, 0x02,                                      // jz +2
+	0xB0, 0xFF,                                      // mov al, 255
+	0x08, 0xFF,                                      // or bh, bh
+	0x74, 0x02,                                      // jz +2
+	0xB3, 0xFF,                                      // mov bl, 255
+	0x88, 0xC4,                                      // mov ah, al
+	0x88, 0xD8,                                      // mov al, bl
+	0x2E, 0x8B, 0x1E, WORD(mm3_frames_addr+4),       // mov bx, cs:frames_count
+	0x83, 0xE3, FRAMES_RING-1,                       // and bx, FRAMES_RING-1
+	0xD1, 0xE3,                                      // shl bx, 1
+	0x2E, 0x89, 0x87, WORD(mm3_frames_addr+8),       // mov cs:[bx+frames_ring], ax
+	0x2E, 0xFF, 0x06, WORD(mm3_frames_addr+4),       // inc cs:frames_count
+	0x9D,                                            // popf
+	0x59,                                            // pop cx
+	0x5B,                                            // pop bx
+	0x58,                                            // pop ax
+	0xC3,                                            // retn
+	// INT 21h vector, swapped with the interrupt table by frames_hook (+85)
+	WORD(mm3_exit_addr), WORD(0),                    // old_int21
+	// telemetry filename (+89)
+	'M','M','F','R','A','M','E','S','.','D','A','T',0,
+};
+// returns ax = time in units of 512 PIT clocks, from the BIOS tick count and PIT channel 0
+const uint8 mm3_clock[] = {
+	0x53,                     // push bx
+	0x52,                     // push dx
+	0x1E,                     // push ds
+	0x9C,                     // pushf
+	0xFA,                     // cli
+	0xB0, 0xC2,               // mov al, C2h ; read back channel 0 status and count
+	0xE6, 0x43,               // out 43h, al
+	0xE4, 0x40,               // in al, 40h
+	0x88, 0xC2,               // mov dl, al ; status
+	0xE4, 0x40,               // in al, 40h
+	0x88, 0xC4,               // mov ah, al
+	0xE4, 0x40,               // in al, 40h
+	0x86, 0xE0,               // xchg al, ah ; count, by 2 in each half of the square wave
+	0xF7, 0xD8,               // neg ax
+	0xD1, 0xE8,               // shr ax, 1 ; clocks into this half
+	0xF6, 0xC2, 0x80,         // test dl, 80h ; output is high in the first half
+	0x75, 0x03,               // jnz first
+	0x80, 0xCC, 0x80,         // or ah, 80h
+	                          //first:
+	0x89, 0xC3,               // mov bx, ax ; clocks into this tick
+	0xB0, 0x0A,               // mov al, 0Ah
+	0xE6, 0x20,               // out 20h, al ; read interrupt requests
+	0xE4, 0x20,               // in al, 20h
+	0x31, 0xD2,               // xor dx, dx
+	0x8E, 0xDA,               // mov ds, dx
+	0x8B, 0x16, WORD(0x046C), // mov dx, ds:046Ch ; BIOS tick count
+	0xF6, 0xC7, 0x80,         // test bh, 80h
+	0x75, 0x05,               // jnz ready
+	0xD0, 0xE8,               // shr al, 1
+	0x83, 0xD2, 0x00,         // adc dx, 0 ; a tick that has started but not yet been counted
+	                          //ready:
+	0x88, 0xD4,               // mov ah, dl
+	0x88, 0xF8,               // mov al, bh
+	0xD0, 0xEE,               // shr dh, 1
+	0xD1, 0xD8,               // rcr ax, 1 ; ticks:clocks / 512
+	0x9D,                     // popf
+	0x1F,                     // pop ds
+	0x5A,                     // pop dx
+	0x5B,                     // pop bx
+	0xC3,                     // retn
+};
+// installs or uninstalls the INT 21h handler
+const uint8 mm3_hook[] = {
+	0x9C,                                // pushf
+	0x50,                                // push ax
+	0x06,                                // push es
+	0xFA,                                // cli
+	0x31, 0xC0,                          // xor ax, ax
+	0x8E, 0xC0,                          // mov es, ax
+	0x2E, 0xA1, WORD(mm3_frame_addr+85), // mov ax, cs:old_int21
+	0x26, 0x87, 0x06, WORD(0x0084),      // xchg ax, es:0084h ; INT 21h vector
+	0x2E, 0xA3, WORD(mm3_frame_addr+85), // mov cs:old_int21, ax
+	0x2E, 0xA1, WORD(mm3_frame_addr+87), // mov ax, cs:old_int21+2
+	0x26, 0x87, 0x06, WORD(0x0086),      // xchg ax, es:0086h
+	0x2E, 0xA3, WORD(mm3_frame_addr+87), // mov cs:old_int21+2, ax
+	0x07,                                // pop es
+	0x58,                                // pop ax
+	0x9D,                                // popf
+	0xC3,                                // retn
+};
+// telemetry header, the ring buffer follows
+const uint8 mm3_frames[] = {
+	'M','M','F',1, // signature and version
+	WORD(0),       // frames_count
+	WORD(0),       // frames_last ; clock at the start of the last frame
+};
+// INT 21h handler, writes the telemetry when the game exits
+const uint8 mm3_exit[] = {
+	0x80, 0xFC, 0x4C,                          // cmp ah, 4Ch ; terminate
+	0x74, 0x0C,                                // jz exit
+	0x08, 0xE4,                                // or ah, ah ; terminate (old)
+	0x74, 0x05,                                // jz old
+	0x2E, 0xFF, 0x2E, WORD(mm3_frame_addr+85), // jmp far cs:old_int21
+	                                           //old:
+	0xB8, WORD(0x4C00),                        // mov ax, 4C00h ; 00h would take the PSP from our CS
+	                                           //exit:
+	CALL(mm3_exit_addr+17,mm3_hook_addr),      // call frames_hook ; uninstall
+	0x50,                                      // push ax
+	0x0E,                                      // push cs
+	0x1F,                                      // pop ds
+	0xB4, 0x3C,                                // mov ah, 3Ch ; create
+	0x31, 0xC9,                                // xor cx, cx
+	0xBA, WORD(mm3_frame_addr+89),             // mov dx, frames_filename
+	0xCD, 0x21,                                // int 21h
+	0x72, 0x0A,                                // jc fail
+	0x93,                                      // xchg bx, ax
+	0xB4, 0x40,                                // mov ah, 40h ; write
+	0xB1, FRAMES_SIZE,                         // mov cl, FRAMES_SIZE
+	0xBA, WORD(mm3_frames_addr),               // mov dx, frames
+	0xCD, 0x21,                                // int 21h ; terminating closes the file
+	                                           //fail:
+	0x58,                                      // pop ax
+	0xCD, 0x21,                                // int 21h ; terminate with the restored vector
+};
+
+const patch mm3_telemetry_patch[] =
+{
+	{ mm3_clock_file, LENGTH(mm3_clock), mm3_clock },
+	{ mm3_frame_file, LENGTH(mm3_frame), mm3_frame },
+	{ mm3_frames_file, LENGTH(mm3_frames), mm3_frames },
+	{ mm3_exit_file, LENGTH(mm3_exit), mm3_exit },
+	{ mm3_hook_file, LENGTH(mm3_hook), mm3_hook },
+	{ mm3_slow0_file, LENGTH(mm3_slow0_frames), mm3_slow0_frames },
+	{0,0,NULL}
+};
+
+// optional adaptive slowdown (-adaptive), see mm1_adapt
+
+// the same space as mm3_frame
+#define mm3_adapt_addr      0x6E14
+#define mm3_adapt_file      0x2283
+
+// replaces the slowdown call in the game loop
+const uint8 mm3_slow0_adapt[] = { CALL(mm3_slow0_addr,mm3_adapt_addr), 0x90, 0x90 };
+// waits for the rest of the frames in the speed setting
+const uint8 mm3_adapt[] = {
+	0x50,                                            // push ax
+	0x51,                                            // push cx
+	0x52,                                            // push dx
+	0x2E, 0x83, 0x3E, WORD(mm3_adapt_addr+86), 0x00, // cmp cs:adapt_refresh, 0
+	0x75, 0x1A,                                      // jnz ready
+	0xB9, WORD(1),                                   // mov cx, 1 ; time one video frame
+	CALL(mm3_adapt_addr+14,mm3_adapt_addr+79),       // call adapt_wait
+	CALL(mm3_adapt_addr+17,mm3_clock_addr),          // call frames_clock
+	0xF7, 0xD8,                                      // neg ax
+	0x2E, 0xA3, WORD(mm3_adapt_addr+86),             // mov cs:adapt_refresh, ax
+	CALL(mm3_adapt_addr+26,mm3_adapt_addr+79),       // call adapt_wait
+	CALL(mm3_adapt_addr+29,mm3_clock_addr),          // call frames_clock
+	0x2E, 0x01, 0x06, WORD(mm3_adapt_addr+86),       // add cs:adapt_refresh, ax
+	                                                 //ready:
+	CALL(mm3_adapt_addr+37,mm3_clock_addr),          // call frames_clock
+	0x2E, 0x2B, 0x06, WORD(mm3_adapt_addr+88),       // sub ax, cs:adapt_last ; time since the last wait
+	0x31, 0xD2,                                      // xor dx, dx
+	0x2E, 0xF7, 0x36, WORD(mm3_adapt_addr+86),       // div cs:adapt_refresh ; whole frames
+	0x2E, 0x8B, 0x0E, WORD(mm3_slow_addr+5),         // mov cx, cs:speed
+	0x29, 0xC1,                                      // sub cx, ax
+	0x73, 0x02,                                      // jnc wait
+	0x31, 0xC9,                                      // xor cx, cx ; already behind
+	                                                 //wait:
+	CALL(mm3_adapt_addr+63,mm3_adapt_addr+79),       // call adapt_wait
+	0x9C,                                            // pushf ; keep the joystick enabled result
+	CALL(mm3_adapt_addr+67,mm3_clock_addr),          // call frames_clock
+	0x2E, 0xA3, WORD(mm3_adapt_addr+88),             // mov cs:adapt_last, ax
+	0x9D,                                            // popf
+	0x5A,                                            // pop dx
+	0x59,                                            // pop cx
+	0x58,                                            // pop ax
+	0xC3,                                            // retn
+	// waits cx frames in the slowdown routine (+79)
+	0x9C,                                            // pushf
+	0x50,                                            // push ax
+	0x51,                                            // push cx
+	0x52,                                            // push dx
+	JMP(mm3_adapt_addr+83,mm3_slow_addr+7),          // jmp slowdown cx frames
+	// adaptive variable storage (+86)
+	WORD(0),                                         // adapt_refresh ; clock time of one video frame
+	WORD(0),                                         // adapt_last ; clock at the end of the last wait
+};
+
+const patch mm3_adaptive_patch[] =
+{
+	{ mm3_clock_file, LENGTH(mm3_clock), mm3_clock },
+	{ mm3_adapt_file, LENGTH(mm3_adapt), mm3_adapt },
+	{ mm3_slow0_file, LENGTH(mm3_slow0_adapt), mm3_slow0_adapt },
+	{0,0,NULL}
+};
+
 // patch set
 const patch mm3_patch[] =
 {
@@ -739,133 +1869,4348 @@ const patch mm3_patch[] =
 	{0,0,NULL}
 };
 
+// fingerprint: original bytes at some of the patched sites, in file order
+const uint8 mm3_table0_original[]   = { WORD(0x501A) };
+const uint8 mm3_table1_original[]   = { WORD(0x5048) };
+const uint8 mm3_settings0_original[] = { 0x8A, 0x26, WORD(0x505A) };        // mov ah, ds:505Ah
+const uint8 mm3_slow0_original[]    = { 0x80, 0x3E, WORD(0x505B), 0x00 }; // cmp ds:505Bh, 0
+const patch mm3_fingerprint[] =
+{
+	{ 0, 2, mz },
+	{ 0x870D, 2, mm3_table0_original },
+	{ 0x874B, 1, five },
+	{ 0x879A, 1, five },
+	{ 0x87B5, 2, mm3_table1_original },
+	{ 0x87CF, 2, mm3_table1_original },
+	{ 0x882D, 1, five },
+	{ mm3_settings0_file, LENGTH(mm3_settings0_original), mm3_settings0_original },
+	{ mm3_slow0_file, LENGTH(mm3_slow0_original), mm3_slow0_original },
+	{0,0,NULL}
+};
+// more original bytes for -scan, the other input polls found by the same search as mm3_slow0
+const patch mm3_signature[] =
+{
+	{ mm3_poll0_file, LENGTH(mm3_slow0_original), mm3_slow0_original },
+	{ mm3_poll1_file, LENGTH(mm3_slow0_original), mm3_slow0_original },
+	{ mm3_poll2_file, LENGTH(mm3_slow0_original), mm3_slow0_original },
+	{ mm3_poll3_file, LENGTH(mm3_slow0_original), mm3_slow0_original },
+	{ mm3_poll4_file, LENGTH(mm3_slow0_original), mm3_slow0_original },
+	{ mm3_poll5_file, LENGTH(mm3_slow0_original), mm3_slow0_original },
+	{ mm3_poll6_file, LENGTH(mm3_slow0_original), mm3_slow0_original },
+	{0,0,NULL}
+};
+
 //
 // Common utilities and main program
 //
 
-int patch_file(const char* filename_in, const char* filename_out, const patch* const patches)
+// patch_file copies the input in runs between patch sites rather than byte by byte
+#define BLOCK_SIZE   4096
+#define MAX_PATCHES  64
+
+uint8 block[BLOCK_SIZE]; // for the main thread only, batch workers use a buffer of their own
+
+// patch_file tries each enabled engine fastest first, and falls back to stdio
+#define ENGINE_MMAP     1
+#define ENGINE_REFLINK  2
+int engines = ENGINE_MMAP | ENGINE_REFLINK;
+
+int debug = 0;       // 1 lists each patch applied (-debug)
+int scan_enabled = 0; // 1 searches an unrecognized file for the patch sites (-scan)
+int unpack = 0;       // 1 writes the output without EXEPACK compression (-unpack)
+int force = 0;        // 1 patches even if the cache shows the output is up to date (-force)
+int inplace = 0;      // 1 patches MM.EXE itself in a disk image (-inplace)
+int quiet = 0;       // 1 suppresses progress messages
+// each batch worker thread counts its own calls, added to the main thread's when it's joined
+#if THREADS
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+THREAD_LOCAL uint32 io_calls = 0; // count of file open, read, write and map calls
+
+//
+// Registry: each supported build of MM.EXE, found by its CRC32 with a perfect hash.
+//
+
+// Supporting another build of either game only needs an entry in games: its CRC32, the files to
+// patch and write, its patch tables, and the fingerprint and signature used by batch mode, -stream and -scan.
+// Builds are found through game_slot, a table of GAME_SLOTS indexed by a multiplicative hash of the
+// CRC32. On first use a multiplier is searched for that gives every build a slot of its own,
+// so a lookup is one multiply and one compare, however many builds there are.
+
+typedef struct
 {
-	FILE* fi;
-	FILE* fo;
-	int i, pos;
-	uint32 copied, patched;
-	const patch* p;
-	char c;
+	uint32 crc;               // CRC32 of MM.EXE
+	int game;                 // 1 or 3
+	const char* name;
+	const char* input;        // file patched, which differs in TEST builds
+	const char* output;
+	const patch* patches;     // standard patches
+	const patch* options[4];  // -poll, -timer, -telemetry and -adaptive patches, in the order applied
+	const patch* fingerprint;
+	const patch* signature;
+} game_build;
 
-	printf("Patching %s into %s...\n", filename_in, filename_out);
-	fi = fopen(filename_in,"rb");
-	if (fi == NULL)
+const game_build games[] = {
+	{ 0xAEA06825, 1, "Mega Man",   FILE_MM1, OUT_MM1, mm1_patch,
+		{ mm1_poll_patch, mm1_timer_patch, mm1_telemetry_patch, mm1_adaptive_patch }, mm1_fingerprint, mm1_signature },
+	{ 0x06C09829, 3, "Mega Man 3", FILE_MM3, OUT_MM3, mm3_patch,
+		{ mm3_poll_patch, mm3_timer_patch, mm3_telemetry_patch, mm3_adaptive_patch }, mm3_fingerprint, mm3_signature },
+};
+
+#define GAMES       ((int)LENGTH(games))
+#define GAME_BITS   3 // GAME_SLOTS should be at least twice GAMES, or a multiplier is hard to find
+#define GAME_SLOTS  (1 << GAME_BITS)
+#define GAME_TRIES  10000
+
+uint8 game_slot[GAME_SLOTS]; // index in games + 1, or 0 if empty
+uint32 game_multiplier = 0;  // 0 until found, then lookups can use the slots
+int games_ready = 0;
+
+// patch sets in use, -poll and then -timer, -telemetry or -adaptive overlay their patches on the standard ones
+const patch* game_set[LENGTH(games)];
+patch game_option_set[LENGTH(games)][4][MAX_PATCHES+1];
+
+uint game_hash(uint32 crc, uint32 multiplier)
+{
+	return (uint)((uint32)(crc * multiplier) >> (32 - GAME_BITS));
+}
+
+// selects the standard patch sets, and searches for a multiplier that puts every build in its own slot
+// if none is found within GAME_TRIES the builds are searched one by one instead
+void games_init()
+{
+	uint32 m;
+	uint h;
+	int i;
+
+	for (i=0; i<GAMES; ++i) game_set[i] = games[i].patches;
+	for (m = 0x9E3779B1UL; m != 0x9E3779B1UL + (2UL * GAME_TRIES); m += 2) // odd multipliers
 	{
-		printf("Unable to open: %s\n",filename_in);
-		return 2;
+		memset(game_slot,0,sizeof(game_slot));
+		for (i=0; i<GAMES; ++i)
+		{
+			h = game_hash(games[i].crc, m);
+			if (game_slot[h]) break;
+			game_slot[h] = (uint8)(i + 1);
+		}
+		if (i >= GAMES)
+		{
+			game_multiplier = m;
+			break;
+		}
 	}
-	fo = fopen(filename_out,"wb");
-	if (fo == NULL)
+	games_ready = 1;
+}
+
+// returns the index in games of the build with this CRC32, or -1 if it isn't recognized
+int identify(uint32 crc)
+{
+	int i;
+
+	if (!games_ready) games_init();
+	if (game_multiplier != 0)
 	{
-		fclose(fi);
-		printf("Unable to open: %s\n",filename_out);
-		return 3;
+		i = (int)game_slot[game_hash(crc, game_multiplier)] - 1;
+		return (i >= 0 && games[i].crc == crc) ? i : -1;
 	}
+	for (i=0; i<GAMES; ++i)
+		if (games[i].crc == crc) return i;
+	return -1;
+}
 
-	copied = 0;
-	patched = 0;
-	pos = 0;
-	while (1)
+// returns the patch set selected for a build, or NULL
+const patch* game_patches(int build)
+{
+	if (!games_ready) games_init();
+	return (build >= 0 && build < GAMES) ? game_set[build] : NULL;
+}
+
+// builds a patch set of option patches followed by a base set,
+// leaving out the bytes of each base patch that an option patch replaces
+const patch* patch_option(patch* set, const patch* option, const patch* base)
+{
+	const patch* o;
+	uint pos, end, next;
+	int i = 0;
+
+	for (o = option; o->data != NULL && i < MAX_PATCHES; ++o) set[i++] = *o;
+	for (; base->data != NULL; ++base)
 	{
-		i = 0;
-		p = patches;
-		while (p->length != 0)
+		pos = base->addr;
+		end = base->addr + base->length;
+		while (pos < end && i < MAX_PATCHES)
 		{
-			if (pos == p->addr)
+			// skip an option patch covering pos, otherwise copy up to the next one
+			next = end;
+			for (o = option; o->data != NULL; ++o)
 			{
-				if (debug) printf("%3d: %04X-%04X: %d bytes\n",i,p->addr,p->addr+p->length-1,p->length);
-				for (i=0; i<p->length; ++i)
-				{
-					fputc(p->data[i],fo);
-					fgetc(fi); // discard (replaced)
-					++pos;
-					++patched;
-				}
-				break;
+				if (o->addr <= pos && pos < (o->addr + o->length)) break;
+				if (o->addr > pos && o->addr < next) next = o->addr;
 			}
+			if (o->data != NULL)
+			{
+				pos = o->addr + o->length;
+				continue;
+			}
+			set[i].addr = pos;
+			set[i].length = next - pos;
+			set[i].data = base->data + (pos - base->addr);
 			++i;
-			p = patches + i;
-		}
-		if (p->length == 0) // not applying patch, copy byte
-		{
-			c = fgetc(fi);
-			if (feof(fi)) break;
-			++pos;
-			fputc(c,fo);
-			++copied;
+			pos = next;
 		}
 	}
+	set[i].addr = 0;
+	set[i].length = 0;
+	set[i].data = NULL;
+	return set;
+}
 
-	printf("%ld bytes copied, %ld bytes patched.\n",copied,patched);
-	fclose(fi);
-	fclose(fo);
-	return 0;
+// -stats and -json record the time and I/O calls spent in each phase,
+// and how many times each entry of the patch set was applied
+enum
+{
+	PHASE_OPEN,
+	PHASE_IDENTIFY,
+	PHASE_COPY,
+	PHASE_PATCH,
+	PHASE_WRITE,
+	PHASE_FSYNC,
+	PHASE_COUNT
+};
+const char* const phase_names[PHASE_COUNT] = { "open", "identify", "copy", "patch", "write", "fsync" };
+
+int stats = 0;
+int phase = -1;
+double phase_start;
+uint32 phase_start_calls;
+double phase_time[PHASE_COUNT];
+uint32 phase_calls[PHASE_COUNT];
+uint32 patch_applied[MAX_PATCHES];
+
+// wall clock in seconds
+double now()
+{
+#if defined(__unix__)
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + (t.tv_nsec * 1e-9);
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
 }
 
-uint32 crc32(const char* filename)
+// ends the current phase and begins the next one, or -1 for none
+void stats_phase(int next)
 {
-	FILE* f;
-	uint32 crc, mask;
-	uint8 c;
-	int i;
+	double t;
 
-	f = fopen(filename,"rb");
-	if (f == NULL)
+	if (!stats) return;
+	t = now();
+	if (phase >= 0)
 	{
-		printf("Unable to open: %s\n",filename);
-		return 0;
+		phase_time[phase] += t - phase_start;
+		phase_calls[phase] += io_calls - phase_start_calls;
 	}
+	phase = next;
+	phase_start = t;
+	phase_start_calls = io_calls;
+}
 
-	crc = ~0UL;
-	while (1)
+// called as each entry of a patch set is applied
+void note_patch(int index, const patch* p)
+{
+#if LIBRARY
+	(void)p; // a library doesn't print the listing
+#else
+	if (debug) printf("%3d: %04X-%04X: %d bytes\n",index,p->addr,p->addr+p->length-1,p->length);
+#endif
+	if (stats) ++patch_applied[index];
+}
+
+// copies up to length bytes from fi to fo through buffer, returns the number of bytes copied
+// fo may be NULL to discard the input instead
+uint32 copy_run(FILE* fi, FILE* fo, uint32 length, uint8* buffer)
+{
+	uint32 copied = 0;
+	uint n, chunk;
+
+	while (copied < length)
 	{
-		c = fgetc(f);
-		if (feof(f)) break;
-		crc = crc ^ c;
-		for (i=0; i<8; ++i)
+		chunk = BLOCK_SIZE;
+		if ((length - copied) < chunk) chunk = (uint)(length - copied);
+		n = fread(buffer,1,chunk,fi);
+		++io_calls;
+		if (n == 0) break;
+		if (fo != NULL)
 		{
-			mask = -(crc & 1);
-			crc = (crc >> 1) ^ (0xEDB88320 & mask);
+			fwrite(buffer,1,n,fo);
+			++io_calls;
 		}
+		copied += n;
+		if (n < chunk) break;
 	}
+	return copied;
+}
 
-	fclose(f);
-	return ~crc;
+// builds a list of patch indices in file order, returns the count or -1 if there are too many
+// the sort is stable, so if two patches share an address the first listed is applied,
+// the same as the original byte-by-byte scan
+int sort_patches(const patch* const patches, uint8* order)
+{
+	int count, i, j;
+	uint8 t;
+
+	count = 0;
+	while (patches[count].length != 0)
+	{
+		if (count >= MAX_PATCHES) return -1;
+		order[count] = count;
+		++count;
+	}
+	for (i=1; i<count; ++i)
+	{
+		t = order[i];
+		for (j=i; j>0 && patches[order[j-1]].addr > patches[t].addr; --j)
+			order[j] = order[j-1];
+		order[j] = t;
+	}
+	return count;
 }
 
-int main()
+#if MMAP
+// inputs at least this large are patched by patch_mmap
+#define MMAP_MIN_SIZE   (16UL * BLOCK_SIZE)
+
+// patch_file for large inputs: the input is mapped read-only, and the output is a mapping
+// filled with memcpy for copy runs and written directly at each patch address
+// returns -1 if the input is too small or can't be mapped, so the stdio path is used instead
+int patch_mmap(const char* filename_in, const char* filename_out, const patch* const patches, const uint8* order, int count, uint32* copied, uint32* patched)
 {
-	uint32 crc;
-	int result = 0;
+	int fi, fo, i, result;
+	struct stat st;
+	uint32 size, out_size, pos;
+	const uint8* src;
+	uint8* dst;
+	const patch* p;
 
-	printf("Opening " FILE_CRC "...\n");
-	crc = crc32(FILE_CRC);
-	printf("CRC32: %08lX\n", crc);
+	fi = open(filename_in,O_RDONLY);
+	++io_calls;
+	if (fi < 0) return -1;
+	// engines == ENGINE_MMAP forces this path regardless of size
+	if (fstat(fi,&st) != 0 || st.st_size > (off_t)0xFFFFFFFFUL ||
+		(st.st_size < (off_t)MMAP_MIN_SIZE && engines != ENGINE_MMAP))
+	{
+		close(fi);
+		return -1;
+	}
+	size = st.st_size;
+	src = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fi,0);
+	++io_calls;
+	close(fi);
+	if (src == MAP_FAILED) return -1;
 
-	if (crc == CRC_MM1 || TEST)
+	// output size: a patch is reached if the input extends to it, and may extend past the end
+	pos = 0;
+	for (i=0; i<count; ++i)
 	{
-		printf("\n");
-		result = patch_file(FILE_MM1, OUT_MM1, mm1_patch);
-		if (result) return result;
+		p = patches + order[i];
+		if (p->addr < pos) continue;
+		if (p->addr > pos && p->addr > size) break;
+		pos = (uint32)p->addr + p->length;
 	}
-	if (crc == CRC_MM3 || TEST)
+	out_size = (pos > size) ? pos : size;
+
+	fo = open(filename_out,O_RDWR|O_CREAT|O_TRUNC,0666);
+	++io_calls;
+	if (fo < 0)
 	{
-		printf("\n");
-		result = patch_file(FILE_MM3, OUT_MM3, mm3_patch);
-		if (result) return result;
+		munmap((void*)src,size);
+		return 3;
 	}
-	if (crc != CRC_MM1 && crc != CRC_MM3)
+	io_calls += 2;
+	if (ftruncate(fo,out_size) != 0 ||
+		(dst = mmap(NULL,out_size,PROT_READ|PROT_WRITE,MAP_SHARED,fo,0)) == MAP_FAILED)
 	{
-		printf("Unrecognized CRC32. Expected:\n");
-		printf("  %08lX - Mega Man\n",CRC_MM1);
-		printf("  %08lX - Mega Man 3\n",CRC_MM3);
-		result = 1;
+		close(fo);
+		munmap((void*)src,size);
+		return 3;
 	}
 
-	return result;
+	*copied = 0;
+	*patched = 0;
+	pos = 0;
+	for (i=0; i<count; ++i)
+	{
+		p = patches + order[i];
+		if (p->addr < pos) continue;
+		if (p->addr > pos && p->addr > size) break;
+		if (p->addr > pos)
+		{
+			stats_phase(PHASE_COPY);
+			memcpy(dst+pos,src+pos,p->addr-pos);
+			*copied += p->addr - pos;
+		}
+		stats_phase(PHASE_PATCH);
+		note_patch(order[i],p);
+		memcpy(dst+p->addr,p->data,p->length);
+		*patched += p->length;
+		pos = (uint32)p->addr + p->length;
+	}
+	if (pos < size)
+	{
+		stats_phase(PHASE_COPY);
+		memcpy(dst+pos,src+pos,size-pos);
+		*copied += size - pos;
+	}
+
+	stats_phase(PHASE_WRITE);
+	result = munmap(dst,out_size);
+	munmap((void*)src,size);
+	if (close(fo) != 0) result = -1;
+	return (result != 0) ? 3 : 0;
 }
+#endif
+
+#if REFLINK
+// patch_file for filesystems with copy-on-write clones (btrfs, XFS):
+// the output is cloned from the input with FICLONE, or copied in-kernel with copy_file_range,
+// and then only the patches are written, one pwritev for each contiguous group.
+// returns -1 if the clone can't be made or the patches would change the file size,
+// so another path is used instead
+// noted is 1 if the patches have already been listed and counted, and this is all the write phase
+int patch_reflink(const char* filename_in, const char* filename_out, const patch* const patches, const uint8* order, int count, int noted, uint32* copied, uint32* patched)
+{
+	int fi, fo, i, n, result;
+	struct stat st;
+	struct iovec iov[MAX_PATCHES];
+	uint32 size, pos, start;
+	ssize_t copy;
+	const patch* p;
+
+	fi = open(filename_in,O_RDONLY);
+	++io_calls;
+	if (fi < 0) return -1;
+	if (fstat(fi,&st) != 0 || st.st_size > (off_t)0xFFFFFFFFUL)
+	{
+		close(fi);
+		return -1;
+	}
+	size = st.st_size;
+	pos = 0;
+	for (i=0; i<count; ++i)
+	{
+		p = patches + order[i];
+		if (p->addr < pos) continue;
+		if (p->addr > size) break;
+		if (((uint32)p->addr + p->length) > size)
+		{
+			close(fi);
+			return -1;
+		}
+		pos = (uint32)p->addr + p->length;
+	}
+
+	fo = open(filename_out,O_WRONLY|O_CREAT|O_TRUNC,0666);
+	++io_calls;
+	if (fo < 0)
+	{
+		close(fi);
+		return -1;
+	}
+	if (!noted) stats_phase(PHASE_COPY);
+	result = (ioctl(fo,FICLONE,fi) == 0) ? 0 : -1;
+	++io_calls;
+	for (pos = 0; result != 0 && pos < size; pos += copy)
+	{
+		copy = copy_file_range(fi,NULL,fo,NULL,size-pos,0);
+		++io_calls;
+		if (copy <= 0) break;
+	}
+	if (pos == size) result = 0;
+	close(fi);
+	if (result != 0)
+	{
+		close(fo);
+		remove(filename_out);
+		return -1;
+	}
+
+	if (!noted) stats_phase(PHASE_PATCH);
+	*patched = 0;
+	pos = 0;
+	n = 0;
+	start = 0;
+	for (i=0; i<=count; ++i)
+	{
+		p = (i < count) ? (patches + order[i]) : NULL;
+		if (p != NULL && p->addr < pos) continue;
+		if (p != NULL && p->addr >= size) p = NULL;
+		// a gap ends the current group
+		if (n > 0 && (p == NULL || p->addr != pos))
+		{
+			if (pwritev(fo,iov,n,start) != (ssize_t)(pos - start)) result = 3;
+			++io_calls;
+			n = 0;
+		}
+		if (p == NULL) break;
+		if (!noted) note_patch(order[i],p);
+		if (n == 0) start = p->addr;
+		iov[n].iov_base = (void*)p->data;
+		iov[n].iov_len = p->length;
+		++n;
+		*patched += p->length;
+		pos = (uint32)p->addr + p->length;
+	}
+	*copied = size - *patched;
+	if (close(fo) != 0) result = 3;
+	return result;
+}
+#endif
+
+// patch_file without messages, which batch workers use
+// returns 0, 2 if the input can't be opened, 3 if the output can't be written,
+// 4 if there are too many patches, or 6 if out of memory
+int patch_run(const char* filename_in, const char* filename_out, const patch* const patches, uint32* copied, uint32* patched)
+{
+	FILE* fi;
+	FILE* fo;
+	int i, count;
+	uint32 pos, run, n;
+	const patch* p;
+	uint8* buffer;
+	uint8 order[MAX_PATCHES];
+
+	stats_phase(PHASE_OPEN);
+	count = sort_patches(patches, order);
+	if (count < 0)
+	{
+		stats_phase(-1);
+		return 4;
+	}
+	i = -1;
+#if REFLINK
+	if (engines & ENGINE_REFLINK) i = patch_reflink(filename_in, filename_out, patches, order, count, 0, copied, patched);
+#endif
+#if MMAP
+	if (i < 0 && (engines & ENGINE_MMAP)) i = patch_mmap(filename_in, filename_out, patches, order, count, copied, patched);
+#endif
+	if (i >= 0)
+	{
+		stats_phase(-1);
+		return i;
+	}
+
+	buffer = malloc(BLOCK_SIZE);
+	if (buffer == NULL)
+	{
+		stats_phase(-1);
+		return 6;
+	}
+	fi = fopen(filename_in,"rb");
+	++io_calls;
+	if (fi == NULL)
+	{
+		free(buffer);
+		stats_phase(-1);
+		return 2;
+	}
+	fo = fopen(filename_out,"wb");
+	++io_calls;
+	if (fo == NULL)
+	{
+		fclose(fi);
+		free(buffer);
+		stats_phase(-1);
+		return 3;
+	}
+
+	*copied = 0;
+	*patched = 0;
+	pos = 0;
+	for (i=0; i<count; ++i)
+	{
+		p = patches + order[i];
+		if (p->addr < pos) continue; // inside an earlier patch, never reached
+		// copy run up to the patch
+		stats_phase(PHASE_COPY);
+		run = p->addr - pos;
+		n = copy_run(fi,fo,run,buffer);
+		*copied += n;
+		pos += n;
+		if (n < run) break; // input ended before this patch
+		// patch run replaces the input bytes, and may extend past the end of the input
+		stats_phase(PHASE_PATCH);
+		note_patch(order[i],p);
+		fwrite(p->data,1,p->length,fo);
+		++io_calls;
+		copy_run(fi,NULL,p->length,buffer);
+		pos += p->length;
+		*patched += p->length;
+	}
+	stats_phase(PHASE_COPY);
+	*copied += copy_run(fi,fo,0xFFFFFFFFUL,buffer); // remainder of file
+	stats_phase(-1);
+
+	free(buffer);
+	fclose(fi);
+	i = ferror(fo) ? 3 : 0;
+	if (fclose(fo) != 0) i = 3;
+	return i;
+}
+
+int patch_file(const char* filename_in, const char* filename_out, const patch* const patches)
+{
+	uint32 copied, patched;
+	int result;
+
+	if (!quiet) printf("Patching %s into %s...\n", filename_in, filename_out);
+	result = patch_run(filename_in, filename_out, patches, &copied, &patched);
+	if (result == 0 && !quiet) printf("%lu bytes copied, %lu bytes patched.\n",(unsigned long)copied,(unsigned long)patched);
+	if (result == 2) printf("Unable to open: %s\n",filename_in);
+	if (result == 3) printf("Unable to write: %s\n",filename_out);
+	if (result == 4) printf("Too many patches.\n");
+	if (result == 6) printf("Out of memory.\n");
+	return result;
+}
+
+// CRC32 is computed with slicing-by-8 tables, built on first use
+uint32 crc_table[8][256];
+int crc_table_ready = 0;
+
+void crc32_init()
+{
+	uint32 c;
+	int i, j;
+
+	for (i=0; i<256; ++i)
+	{
+		c = i;
+		for (j=0; j<8; ++j)
+			c = (c >> 1) ^ (0xEDB88320UL & -(c & 1));
+		crc_table[0][i] = c;
+	}
+	for (i=0; i<256; ++i)
+	{
+		c = crc_table[0][i];
+		for (j=1; j<8; ++j)
+		{
+			c = (c >> 8) ^ crc_table[0][c & 0xFF];
+			crc_table[j][i] = c;
+		}
+	}
+	crc_table_ready = 1;
+}
+
+// continues a CRC32 over a block of data
+// start with crc = ~0, and invert the result when finished
+uint32 crc32_update(uint32 crc, const uint8* data, uint length)
+{
+	if (!crc_table_ready) crc32_init();
+	while (length >= 8)
+	{
+		crc ^= data[0] | ((uint32)data[1] << 8) | ((uint32)data[2] << 16) | ((uint32)data[3] << 24);
+		crc =
+			crc_table[7][crc & 0xFF] ^
+			crc_table[6][(crc >> 8) & 0xFF] ^
+			crc_table[5][(crc >> 16) & 0xFF] ^
+			crc_table[4][crc >> 24] ^
+			crc_table[3][data[4]] ^
+			crc_table[2][data[5]] ^
+			crc_table[1][data[6]] ^
+			crc_table[0][data[7]];
+		data += 8;
+		length -= 8;
+	}
+	while (length > 0)
+	{
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *data) & 0xFF];
+		++data;
+		--length;
+	}
+	return crc;
+}
+
+// continues a CRC32 over a run of zero bytes
+const uint8 zeros[256] = { 0 };
+uint32 crc32_zeros(uint32 crc, uint32 length)
+{
+	uint n;
+
+	if (crc == 0) return 0; // a raw CRC stays 0 until the first non-zero byte
+	while (length > 0)
+	{
+		n = (length < sizeof(zeros)) ? (uint)length : sizeof(zeros);
+		crc = crc32_update(crc,zeros,n);
+		length -= n;
+	}
+	return crc;
+}
+
+// computes the CRC32 of a file without messages, returns 0 if it can't be read
+// each call has its own buffer, so batch workers can use it
+int crc32_file(const char* filename, uint32* crc)
+{
+	FILE* f;
+	uint8* buffer;
+	uint32 c;
+	uint n;
+	int result;
+
+	buffer = malloc(BLOCK_SIZE);
+	if (buffer == NULL) return 0;
+	f = fopen(filename,"rb");
+	++io_calls;
+	if (f == NULL)
+	{
+		free(buffer);
+		return 0;
+	}
+
+	c = 0xFFFFFFFFUL;
+	while ((n = fread(buffer,1,BLOCK_SIZE,f)) > 0)
+	{
+		c = crc32_update(c,buffer,n);
+		++io_calls;
+	}
+	++io_calls;
+
+	result = !ferror(f);
+	fclose(f);
+	free(buffer);
+	*crc = ~c;
+	return result;
+}
+
+uint32 crc32(const char* filename)
+{
+	uint32 crc;
+
+	if (!crc32_file(filename,&crc))
+	{
+		printf("Unable to open: %s\n",filename);
+		return 0;
+	}
+	return crc;
+}
+
+// Fingerprints reject most files in a few small reads, before a full CRC32 is needed.
+// The file must be large enough to hold every patch, and contain the original bytes
+// of the sampled patch sites. A file that passes must still be confirmed by its CRC32.
+
+// returns the end of the last patch, which the file size must reach
+uint32 patch_extent(const patch* p)
+{
+	uint32 extent = 0;
+	for (; p->length != 0; ++p)
+		if (((uint32)p->addr + p->length) > extent) extent = (uint32)p->addr + p->length;
+	return extent;
+}
+
+int fingerprint_match(FILE* f, long size, const patch* const patches, const patch* samples)
+{
+	uint8 sample[8];
+
+	if (size < 0 || (uint32)size < patch_extent(patches)) return 0;
+	for (; samples->length != 0; ++samples)
+	{
+		if (samples->length > sizeof(sample)) return 0;
+		++io_calls;
+		if (fseek(f,samples->addr,SEEK_SET) != 0) return 0;
+		++io_calls;
+		if (fread(sample,1,samples->length,f) != samples->length) return 0;
+		if (memcmp(sample,samples->data,samples->length)) return 0;
+	}
+	return 1;
+}
+
+// checks the samples against the start of a file held in memory, which is size bytes long
+int fingerprint_data(const uint8* data, uint32 size, const patch* samples)
+{
+	for (; samples->length != 0; ++samples)
+	{
+		if (((uint32)samples->addr + samples->length) > size) return 0;
+		if (memcmp(data+samples->addr,samples->data,samples->length)) return 0;
+	}
+	return 1;
+}
+
+// returns the index in games of the first build a file might be, -1 if it's not a candidate,
+// or -2 if it can't be opened
+int fingerprint(const char* filename)
+{
+	FILE* f;
+	long size;
+	int i = GAMES;
+
+	f = fopen(filename,"rb");
+	++io_calls;
+	if (f == NULL) return -2;
+	++io_calls;
+	if (fseek(f,0,SEEK_END) == 0)
+	{
+		size = ftell(f);
+		for (i=0; i<GAMES; ++i)
+			if (fingerprint_match(f, size, games[i].patches, games[i].fingerprint)) break;
+	}
+	fclose(f);
+	return (i < GAMES) ? i : -1;
+}
+
+//
+// Signature scan (-scan): relocates a patch set for an executable with an unrecognized CRC32.
+//
+
+// A variant such as a re-release may hold the same code at another file offset, for example
+// after a larger header. The fingerprint and signature patterns of both games are built into
+// one Aho-Corasick automaton, so the file is searched for all of them in a single pass.
+// The matches of a game's rarest pattern give its candidate offsets, and each is checked
+// against every sample of that game. The set is only relocated if exactly one game and offset fit.
+// Segment addresses in the patches are unchanged, so the code must have moved only in the file.
+
+#define SCAN_STATES    128
+#define SCAN_PATTERNS  32
+#define SCAN_MATCHES   8
+
+typedef struct
+{
+	const uint8* data;
+	uint length;
+	uint32 count;               // number of matches
+	uint32 match[SCAN_MATCHES]; // file offsets of the first matches
+} scan_pattern;
+
+uint8 scan_label[SCAN_STATES];   // byte leading to this state from its parent
+uint8 scan_child[SCAN_STATES];   // first child, 0 if none
+uint8 scan_sibling[SCAN_STATES]; // next child of the same parent, 0 if none
+uint8 scan_fail[SCAN_STATES];    // state for the longest proper suffix in the trie
+uint8 scan_report[SCAN_STATES];  // nearest state down the fail chain that ends a pattern, 0 if none
+uint8 scan_output[SCAN_STATES];  // pattern index + 1 that ends at this state, 0 if none
+int scan_states = 1;
+scan_pattern scan_patterns[SCAN_PATTERNS];
+int scan_pattern_count = 0;
+patch scan_set[MAX_PATCHES+1];
+
+// returns the child of a state for a byte, or 0 if there is none
+uint scan_goto(uint s, uint8 c)
+{
+	for (s = scan_child[s]; s != 0; s = scan_sibling[s])
+		if (scan_label[s] == c) return s;
+	return 0;
+}
+
+// returns the state at the end of a sample's bytes, or 0 if it isn't in the trie
+uint scan_find(const patch* sample)
+{
+	uint s, j;
+
+	s = 0;
+	for (j=0; j<sample->length; ++j)
+		if ((s = scan_goto(s, sample->data[j])) == 0) return 0;
+	return s;
+}
+
+// adds a list of samples to the trie, returns -1 if it's full
+// samples at file offset 0 are part of the header, which is checked in place instead
+int scan_add(const patch* samples)
+{
+	uint s, t, j;
+
+	for (; samples->length != 0; ++samples)
+	{
+		if (samples->addr == 0) continue;
+		s = 0;
+		for (j=0; j<samples->length; ++j)
+		{
+			t = scan_goto(s, samples->data[j]);
+			if (t == 0)
+			{
+				if (scan_states >= SCAN_STATES) return -1;
+				t = scan_states++;
+				scan_label[t] = samples->data[j];
+				scan_sibling[t] = scan_child[s];
+				scan_child[s] = t;
+			}
+			s = t;
+		}
+		if (scan_output[s] == 0)
+		{
+			if (scan_pattern_count >= SCAN_PATTERNS) return -1;
+			scan_patterns[scan_pattern_count].data = samples->data;
+			scan_patterns[scan_pattern_count].length = samples->length;
+			scan_output[s] = ++scan_pattern_count;
+		}
+	}
+	return 0;
+}
+
+// builds the fail and report links breadth first, so each state's fail state is done before it
+void scan_link()
+{
+	uint8 queue[SCAN_STATES];
+	uint head, tail, s, t, f;
+
+	head = tail = 0;
+	for (t = scan_child[0]; t != 0; t = scan_sibling[t]) queue[tail++] = t;
+	while (head < tail)
+	{
+		s = queue[head++];
+		for (t = scan_child[s]; t != 0; t = scan_sibling[t])
+		{
+			f = scan_fail[s];
+			while (f != 0 && scan_goto(f, scan_label[t]) == 0) f = scan_fail[f];
+			f = scan_goto(f, scan_label[t]);
+			scan_fail[t] = f;
+			scan_report[t] = scan_output[f] ? f : scan_report[f];
+			queue[tail++] = t;
+		}
+	}
+}
+
+// counts the matches of every pattern in one pass over the data
+void scan_search(const uint8* data, uint32 size)
+{
+	uint32 i;
+	uint s, t;
+	scan_pattern* p;
+
+	for (i=0; i<(uint32)scan_pattern_count; ++i) scan_patterns[i].count = 0;
+	s = 0;
+	for (i=0; i<size; ++i)
+	{
+		while ((t = scan_goto(s, data[i])) == 0 && s != 0) s = scan_fail[s];
+		s = t;
+		for (t = scan_output[s] ? s : scan_report[s]; t != 0; t = scan_report[t])
+		{
+			p = scan_patterns + scan_output[t] - 1;
+			if (p->count < SCAN_MATCHES) p->match[p->count] = i + 1 - p->length;
+			++p->count;
+		}
+	}
+}
+
+// returns 1 if every sample is found at its file offset moved by delta
+int scan_fit(const uint8* data, uint32 size, const patch* samples, long delta)
+{
+	long pos;
+
+	for (; samples->length != 0; ++samples)
+	{
+		pos = (long)samples->addr;
+		if (pos != 0) pos += delta;
+		if (pos < 0 || ((uint32)pos + samples->length) > size) return 0;
+		if (memcmp(data+pos,samples->data,samples->length)) return 0;
+	}
+	return 1;
+}
+
+// returns 1 if every patch still fits in the file and a file offset after moving by delta
+int scan_fit_patches(uint32 size, const patch* p, long delta)
+{
+	long pos;
+
+	for (; p->length != 0; ++p)
+	{
+		pos = (long)p->addr + delta;
+		if (pos < 0 || (long)(uint)pos != pos || ((uint32)pos + p->length) > size) return 0;
+	}
+	return 1;
+}
+
+// finds the offsets where every sample of a game fits, returns how many or -1 if its rarest
+// pattern matched too often to tell, and the last offset found in delta
+int scan_game(const uint8* data, uint32 size, const patch* fingerprint, const patch* signature, const patch* patches, long* delta)
+{
+	const patch* lists[2];
+	const patch* sample;
+	const patch* rarest = NULL;
+	scan_pattern* p;
+	scan_pattern* rp = NULL;
+	long d;
+	uint32 i;
+	uint s;
+	int k, found;
+
+	lists[0] = fingerprint;
+	lists[1] = signature;
+	for (k=0; k<2; ++k)
+	{
+		for (sample = lists[k]; sample->length != 0; ++sample)
+		{
+			if (sample->addr == 0) continue;
+			s = scan_find(sample);
+			if (s == 0 || scan_output[s] == 0) return 0;
+			p = scan_patterns + scan_output[s] - 1;
+			if (rp == NULL || p->count < rp->count)
+			{
+				rp = p;
+				rarest = sample;
+			}
+		}
+	}
+	if (rp == NULL || rp->count == 0) return 0;
+	if (rp->count > SCAN_MATCHES) return -1;
+	found = 0;
+	for (i=0; i<rp->count; ++i)
+	{
+		d = (long)rp->match[i] - (long)rarest->addr;
+		if (scan_fit(data, size, fingerprint, d) &&
+			scan_fit(data, size, signature, d) &&
+			scan_fit_patches(size, patches, d))
+		{
+			*delta = d;
+			++found;
+		}
+	}
+	return found;
+}
+
+// returns 1 if an earlier build in games has the same samples, so it doesn't need scanning again
+int scan_repeated(int build)
+{
+	int i;
+
+	for (i=0; i<build; ++i)
+		if (games[i].fingerprint == games[build].fingerprint && games[i].signature == games[build].signature) return 1;
+	return 0;
+}
+
+// returns the index in games of the build whose samples fit the data at exactly one offset,
+// or -1 if none, with its patch set relocated to that offset in set
+int scan(const uint8* data, uint32 size, const patch** set)
+{
+	const patch* p;
+	long d, delta = 0;
+	int build = -1, found = 0, n, i;
+
+	if (scan_states == 1)
+	{
+		for (i=0; i<GAMES; ++i)
+		{
+			if (scan_repeated(i)) continue;
+			if (scan_add(games[i].fingerprint) || scan_add(games[i].signature))
+			{
+				printf("Too many signature patterns to scan.\n");
+				return -1;
+			}
+		}
+		scan_link();
+	}
+	scan_search(data, size);
+	for (i=0; i<GAMES; ++i)
+	{
+		if (scan_repeated(i)) continue;
+		n = scan_game(data, size, games[i].fingerprint, games[i].signature, game_patches(i), &d);
+		if (n < 0) found = 2;
+		if (n > 0)
+		{
+			found += n;
+			build = i;
+			delta = d;
+		}
+	}
+	if (found > 1)
+	{
+		printf("Signature scan is ambiguous.\n");
+		return -1;
+	}
+	if (found == 0)
+	{
+		printf("Signature scan found no match.\n");
+		return -1;
+	}
+	p = game_patches(build);
+	for (i=0; p[i].length != 0; ++i)
+	{
+		scan_set[i] = p[i];
+		scan_set[i].addr = (uint)((long)p[i].addr + delta);
+	}
+	scan_set[i] = p[i];
+	*set = scan_set;
+	printf("Signatures match %s at file offset %+ld.\n", games[build].name, delta);
+	return build;
+}
+
+//
+// Single-read pipeline: the file is loaded once to identify, patch and verify it in memory.
+//
+
+typedef struct
+{
+	uint32 copied;
+	uint32 patched;
+	uint32 crc;      // CRC32 of the patched output
+	uint32 expected; // output CRC32 predicted from the input CRC32 and the patched bytes
+	// set by patch_game
+	uint32 crc_in;   // CRC32 of the input
+	int build;       // index in games, or -1 if unrecognized
+	const patch* patches;
+} patch_result;
+
+// loads an entire file, returns NULL if it can't be opened or won't fit in memory
+uint8* load_file(const char* filename, uint32* size)
+{
+	FILE* f;
+	long length;
+	uint8* data;
+
+	f = fopen(filename,"rb");
+	++io_calls;
+	if (f == NULL) return NULL;
+	data = NULL;
+	if (fseek(f,0,SEEK_END) == 0 &&
+		(length = ftell(f)) >= 0 &&
+		(uint32)(size_t)length == (uint32)length &&
+		fseek(f,0,SEEK_SET) == 0)
+	{
+		data = malloc(length > 0 ? (size_t)length : 1);
+		++io_calls;
+		if (data != NULL && fread(data,1,(size_t)length,f) != (size_t)length)
+		{
+			free(data);
+			data = NULL;
+		}
+		*size = length;
+	}
+	fclose(f);
+	return data;
+}
+
+// applies a patch set in place, computing the output CRC32 as it goes
+// returns -1 if the patches would change the size of the file, and leaves the data unmodified
+//
+// The expected output CRC32 uses the linearity of CRC32: for inputs of equal length,
+// crc(a) ^ crc(b) == raw(a ^ b), where raw is a CRC32 with no initial or final inversion.
+// Only the bytes changed by each patch contribute, so this verifies independently of the
+// output CRC that the buffer differs from the identified input in exactly the patched bytes.
+int patch_buffer(uint8* data, uint32 size, uint32 crc_in, const patch* const patches, patch_result* r)
+{
+	int i, count;
+	uint j;
+	uint32 pos, crc, delta;
+	const patch* p;
+	uint8 order[MAX_PATCHES];
+
+	count = sort_patches(patches, order);
+	if (count < 0) return -1;
+	pos = 0;
+	for (i=0; i<count; ++i)
+	{
+		p = patches + order[i];
+		if (p->addr < pos) continue;
+		if (p->addr > size) break;
+		if (((uint32)p->addr + p->length) > size) return -1;
+		pos = (uint32)p->addr + p->length;
+	}
+
+	r->copied = 0;
+	r->patched = 0;
+	crc = 0xFFFFFFFFUL;
+	delta = 0;
+	pos = 0;
+	for (i=0; i<count; ++i)
+	{
+		p = patches + order[i];
+		if (p->addr < pos) continue;
+		if (p->addr >= size) break;
+		note_patch(order[i],p);
+		crc = crc32_update(crc,data+pos,(uint)(p->addr-pos));
+		delta = crc32_zeros(delta,p->addr-pos);
+		r->copied += p->addr - pos;
+		for (j=0; j<p->length; ++j)
+			delta = (delta >> 8) ^ crc_table[0][(delta ^ data[p->addr+j] ^ p->data[j]) & 0xFF];
+		memcpy(data+p->addr,p->data,p->length);
+		crc = crc32_update(crc,p->data,p->length);
+		r->patched += p->length;
+		pos = (uint32)p->addr + p->length;
+	}
+	crc = crc32_update(crc,data+pos,(uint)(size-pos));
+	delta = crc32_zeros(delta,size-pos);
+	r->copied += size - pos;
+	r->crc = ~crc;
+	r->expected = crc_in ^ delta;
+	return 0;
+}
+
+//
+// Library: identifies, patches and verifies a game held in memory.
+//
+
+// Nothing here opens a file or prints, so a launcher can build this file with LIBRARY 1
+// and patch the game in memory as it loads it, for example:
+//   set_options(OPTION_POLL);
+//   if (patch_game(data, size, &r) == 0) ... // data now holds MM1.EXE or MM3.EXE
+// The command line modes are wrappers that add the files and messages.
+// identify and game_patches are with the registry of builds, above.
+
+// the bit for each option is its index in game_build.options
+#define OPTION_POLL       1
+#define OPTION_TIMER      2
+#define OPTION_TELEMETRY  4
+#define OPTION_ADAPTIVE   8
+
+// selects the patch sets for a combination of OPTION flags, returns 0 if they can't be combined
+// the -timer slowdown routine replaces the -poll vsync routine, so it goes on last
+int set_options(uint options)
+{
+	uint exclusive = options & (OPTION_TIMER | OPTION_TELEMETRY | OPTION_ADAPTIVE);
+	int i, j;
+
+	if (exclusive & (exclusive - 1)) return 0;
+	if (!games_ready) games_init();
+	for (i=0; i<GAMES; ++i)
+	{
+		game_set[i] = games[i].patches;
+		for (j=0; j<4; ++j)
+			if (options & (1 << j))
+				game_set[i] = patch_option(game_option_set[i][j], games[i].options[j], game_set[i]);
+	}
+	return 1;
+}
+
+// identifies data by its CRC32, then applies and verifies the game's patch set in place
+// returns 0 if patched, 1 if unrecognized, 4 if the patches don't fit, or 5 if verification failed
+int patch_game(uint8* data, uint32 size, patch_result* r)
+{
+	r->crc_in = ~crc32_update(0xFFFFFFFFUL, data, (uint)size);
+	r->build = identify(r->crc_in);
+	r->patches = game_patches(r->build);
+	if (r->patches == NULL) return 1;
+	if (patch_buffer(data, size, r->crc_in, r->patches, r)) return 4;
+	return (r->crc == r->expected) ? 0 : 5;
+}
+
+// writes data to a temporary file next to filename, then renames it into place
+// data must be filename_in with patches applied by patch_buffer, and crc its CRC32,
+// so that where possible the output can be cloned from filename_in with only the patches written,
+// or filename_in is NULL if it can't be
+// filename_in may have changed since it was loaded, so a clone is kept only if its CRC32 is crc
+int write_file(const char* filename_in, const char* filename, const uint8* data, uint32 size, uint32 crc, const patch* const patches)
+{
+	FILE* f;
+	char temp[FILENAME_MAX];
+	char* ext;
+	int result;
+#if defined(__unix__)
+	int fd;
+#endif
+#if REFLINK
+	uint8 order[MAX_PATCHES];
+	uint32 copied, patched, cloned;
+	int count;
+#endif
+
+	if (strlen(filename) + 5 > sizeof(temp)) return 3;
+	strcpy(temp,filename);
+	ext = strrchr(temp,'.');
+	if (ext == NULL || strchr(ext,'/') != NULL || strchr(ext,'\\') != NULL) ext = temp + strlen(temp);
+	strcpy(ext,".$$$");
+
+	stats_phase(PHASE_WRITE);
+	result = -1;
+#if REFLINK
+	count = sort_patches(patches, order);
+	if (count >= 0 && filename_in != NULL && (engines & ENGINE_REFLINK))
+	{
+		// patch_buffer has already listed and counted the patches
+		result = patch_reflink(filename_in, temp, patches, order, count, 1, &copied, &patched);
+		if (result == 0 && (!crc32_file(temp,&cloned) || cloned != crc)) result = -1;
+	}
+#endif
+	if (result < 0)
+	{
+		f = fopen(temp,"wb");
+		++io_calls;
+		if (f == NULL) return 3;
+		result = (fwrite(data,1,(size_t)size,f) != (size_t)size);
+		++io_calls;
+		if (fclose(f) != 0) result = 1;
+	}
+#if defined(__unix__)
+	// flush the temporary file to disk, so the rename can't expose a partial file
+	stats_phase(PHASE_FSYNC);
+	fd = open(temp,O_RDONLY);
+	++io_calls;
+	if (fd >= 0)
+	{
+		fsync(fd);
+		++io_calls;
+		close(fd);
+	}
+	stats_phase(PHASE_WRITE);
+#endif
+	if (result)
+	{
+		stats_phase(-1);
+		remove(temp);
+		return 3;
+	}
+	// rename replaces the target in one step where the platform allows it, DOS needs it removed first
+	if (rename(temp,filename) != 0)
+	{
+		remove(filename);
+		if (rename(temp,filename) != 0)
+		{
+			stats_phase(-1);
+			remove(temp);
+			return 3;
+		}
+	}
+	stats_phase(-1);
+	return 0;
+}
+
+// patches a file loaded by load_file and writes the result, with its CRC32 in crc_out
+// returns -1 if this patch set can't be applied in memory, and patch_file should be used instead
+int patch_memory(uint8* data, uint32 size, uint32 crc_in, const char* filename_in, const char* filename_out, const patch* const patches, uint32* crc_out)
+{
+	patch_result r;
+	int result;
+
+	stats_phase(PHASE_PATCH);
+	result = patch_buffer(data, size, crc_in, patches, &r);
+	stats_phase(-1);
+	if (result != 0) return -1;
+	printf("Patching %s into %s...\n", filename_in, filename_out);
+	printf("%lu bytes copied, %lu bytes patched.\n",(unsigned long)r.copied,(unsigned long)r.patched);
+	printf("Output CRC32: %08lX\n",(unsigned long)r.crc);
+	if (r.crc != r.expected)
+	{
+		printf("Output verification failed, expected: %08lX\n",(unsigned long)r.expected);
+		return 5;
+	}
+	*crc_out = r.crc;
+	if (write_file(filename_in, filename_out, data, size, r.crc, patches))
+	{
+		printf("Unable to write: %s\n",filename_out);
+		return 3;
+	}
+	return 0;
+}
+
+//
+// EXEPACK (-unpack): writes the patched game as a plain executable that skips self-extraction.
+//
+
+// An EXEPACK executable's entry point is a header and decompressor stub placed after the packed
+// image. The image is expanded backwards in place from its end by a list of fill and copy
+// commands, then the stub applies its own packed relocation table and jumps to the real entry.
+// Here the image is expanded into a new buffer with a rebuilt MZ header and relocation table.
+// Each patch's file offset in the packed executable is carried to the unpacked one by the copy
+// command that moves its bytes, so no second table of offsets is needed. A patch that isn't
+// wholly inside one copy, or the unpacked prefix, is refused.
+
+#define EXEPACK_SIGNATURE   0x4252 // "RB"
+#define MZ_HEADER_SIZE      0x1C
+
+const char exepack_corrupt[] = "Packed file is corrupt";
+
+patch unpack_set[MAX_PATCHES+1];
+long unpack_offset[MAX_PATCHES]; // unpacked image offset of each patch, -1 until found
+
+uint get16(const uint8* p)
+{
+	return p[0] | ((uint)p[1] << 8);
+}
+
+void put16(uint8* p, uint v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+}
+
+// finds the patches in a run of the packed image that the decompressor moves from src to dst
+// returns -1 if a patch overlaps the run without being entirely inside it
+// a patch already found by a copy keeps its offset, since the prefix also covers leftover packed bytes
+int unpack_map(const patch* const patches, long header, uint32 src, uint32 dst, uint32 length)
+{
+	long pos;
+	int i;
+
+	for (i=0; patches[i].length != 0; ++i)
+	{
+		if (unpack_offset[i] >= 0) continue;
+		pos = (long)patches[i].addr - header;
+		if ((pos + (long)patches[i].length) <= (long)src || pos >= (long)(src + length)) continue;
+		if (pos < (long)src || (pos + (long)patches[i].length) > (long)(src + length)) return -1;
+		unpack_offset[i] = pos - (long)src + (long)dst;
+	}
+	return 0;
+}
+
+// expands the packed image of length packed into out, which holds length bytes
+// returns nonzero if the command list is corrupt or a patch can't be mapped
+int unpack_data(const uint8* image, uint32 packed, uint8* out, uint32 length, const patch* const patches, long header)
+{
+	uint32 src, dst, count;
+	uint8 command;
+
+	src = packed;
+	dst = length;
+	while (src > 0 && image[src-1] == 0xFF) --src; // padding
+	do
+	{
+		if (src < 3) return 1;
+		command = image[src-1];
+		count = get16(image+src-3);
+		src -= 3;
+		if (count > dst) return 1;
+		dst -= count;
+		if ((command & 0xFE) == 0xB0) // fill
+		{
+			if (src < 1) return 1;
+			memset(out+dst,image[src-1],(size_t)count);
+			src -= 1;
+		}
+		else if ((command & 0xFE) == 0xB2) // copy
+		{
+			if (count > src) return 1;
+			src -= count;
+			memcpy(out+dst,image+src,(size_t)count);
+			if (unpack_map(patches, header, src, dst, count)) return 2;
+		}
+		else return 1;
+	} while (!(command & 1));
+	// the remaining prefix was never packed, and stays where it is,
+	// along with any packed bytes left between it and the expanded data
+	if (src > dst || dst > packed) return 1;
+	memcpy(out,image,(size_t)dst);
+	if (unpack_map(patches, header, 0, 0, dst)) return 2;
+	return 0;
+}
+
+typedef struct
+{
+	const uint8* image;  // load image following the MZ header
+	const uint8* ep;     // EXEPACK header at the entry segment
+	const uint8* relocs; // packed relocation table
+	uint32 header;       // MZ header size
+	uint32 load;         // load image size
+	uint32 packed;       // size of the packed data at the start of the image
+	uint32 length;       // unpacked image size
+	uint32 relocations;  // relocation count
+} exepack;
+
+// reads the headers of an EXEPACK executable, returns 0 if it isn't one
+int exepack_parse(const uint8* data, uint32 size, exepack* x)
+{
+	const uint8* p;
+	uint32 i, entry;
+	uint skip, count;
+	int k;
+
+	if (size < MZ_HEADER_SIZE || memcmp(data,mz,2)) return 0;
+	x->header = (uint32)get16(data+0x08) << 4;
+	x->load = ((uint32)get16(data+0x04) << 9) - (get16(data+0x02) ? (512 - get16(data+0x02)) : 0);
+	if (x->load > size) x->load = size;
+	if (x->header >= x->load) return 0;
+	x->image = data + x->header;
+	x->load -= x->header;
+	entry = (uint32)get16(data+0x16) << 4;
+	if ((entry + 18) > x->load) return 0;
+	x->ep = x->image + entry;
+	if      (get16(x->ep+14) == EXEPACK_SIGNATURE) skip = 1;
+	else if (get16(x->ep+16) == EXEPACK_SIGNATURE) skip = get16(x->ep+14);
+	else return 0;
+	if (skip < 1 || ((uint32)(skip - 1) << 4) > entry) return 0;
+	x->packed = entry - ((uint32)(skip - 1) << 4);
+	x->length = (uint32)get16(x->ep+12) << 4;
+
+	// the packed relocation table follows the stub's error message, in 16 blocks of 64k
+	x->relocs = NULL;
+	for (i = entry; (i + sizeof(exepack_corrupt) - 1) <= x->load; ++i)
+	{
+		if (!memcmp(x->image+i,exepack_corrupt,sizeof(exepack_corrupt)-1))
+		{
+			x->relocs = x->image + i + sizeof(exepack_corrupt) - 1;
+			break;
+		}
+	}
+	if (x->relocs == NULL) return 0;
+	x->relocations = 0;
+	p = x->relocs;
+	for (k=0; k<16; ++k)
+	{
+		if ((uint32)(p + 2 - x->image) > x->load) return 0;
+		count = get16(p);
+		x->relocations += count;
+		p += 2 + ((uint32)count * 2);
+	}
+	if ((uint32)(p - x->image) > x->load || x->relocations > 0xFFFF) return 0;
+	return 1;
+}
+
+// unpacks an EXEPACK executable, and patches and writes the result, with its CRC32 in crc_out
+// patches are given as file offsets in the packed executable
+int patch_unpacked(const uint8* data, uint32 size, const char* filename_out, const patch* const patches, uint32* crc_out)
+{
+	exepack x;
+	const uint8* p;
+	uint8* out;
+	uint32 header, total, i, crc;
+	uint count, max_alloc;
+	long min_alloc;
+	int j, k, result;
+	patch_result r;
+
+	if (!exepack_parse(data, size, &x))
+	{
+		printf("Not an EXEPACK executable.\n");
+		return 7;
+	}
+	header = (MZ_HEADER_SIZE + (x.relocations * 4) + 15) & ~15UL;
+	total = header + x.length;
+	out = NULL;
+	if ((uint32)(size_t)total == total) out = malloc((size_t)total);
+	if (out == NULL)
+	{
+		printf("Out of memory.\n");
+		return 6;
+	}
+
+	for (j=0; j<MAX_PATCHES; ++j) unpack_offset[j] = -1;
+	result = unpack_data(x.image, x.packed, out + header, x.length, patches, (long)x.header);
+	if (result == 1)
+	{
+		free(out);
+		printf("Packed data is corrupt.\n");
+		return 7;
+	}
+	for (j=0; result == 0 && patches[j].length != 0; ++j)
+	{
+		if (unpack_offset[j] < 0 ||
+			((uint32)unpack_offset[j] + patches[j].length) > x.length ||
+			(long)(uint)(unpack_offset[j] + header) != (long)(unpack_offset[j] + header))
+			break;
+		unpack_set[j] = patches[j];
+		unpack_set[j].addr = (uint)(unpack_offset[j] + header);
+		if (debug) printf("  %2d: %04X -> %04X\n",j,patches[j].addr,unpack_set[j].addr);
+	}
+	if (result != 0 || patches[j].length != 0)
+	{
+		free(out);
+		printf("A patch is not within the unpacked data.\n");
+		return 8;
+	}
+	unpack_set[j] = patches[j];
+
+	// rebuilt header, keeping all the memory that was reserved for the packed program
+	memset(out,0,(size_t)header);
+	memcpy(out,mz,2);
+	put16(out+0x02,(uint)(total & 511));
+	put16(out+0x04,(uint)((total + 511) >> 9));
+	put16(out+0x06,(uint)x.relocations);
+	put16(out+0x08,(uint)(header >> 4));
+	min_alloc = (long)((x.load + 15) >> 4) + get16(data+0x0A) - (long)(x.length >> 4);
+	if (min_alloc < 0) min_alloc = 0;
+	if (min_alloc > 0xFFFF) min_alloc = 0xFFFF;
+	max_alloc = get16(data+0x0C);
+	if ((long)max_alloc < min_alloc) max_alloc = (uint)min_alloc;
+	put16(out+0x0A,(uint)min_alloc);
+	put16(out+0x0C,max_alloc);
+	put16(out+0x0E,get16(x.ep+10)); // ss
+	put16(out+0x10,get16(x.ep+8)); // sp
+	put16(out+0x14,get16(x.ep+0)); // ip
+	put16(out+0x16,get16(x.ep+2)); // cs
+	put16(out+0x18,MZ_HEADER_SIZE);
+	i = MZ_HEADER_SIZE;
+	p = x.relocs;
+	for (k=0; k<16; ++k)
+	{
+		count = get16(p);
+		for (p += 2; count > 0; --count, p += 2, i += 4)
+		{
+			put16(out+i,get16(p));
+			put16(out+i+2,(uint)k << 12);
+		}
+	}
+
+	printf("Unpacking into %s...\n", filename_out);
+	crc = ~crc32_update(0xFFFFFFFFUL, out, (uint)total);
+	stats_phase(PHASE_PATCH);
+	result = patch_buffer(out, total, crc, unpack_set, &r);
+	stats_phase(-1);
+	if (result != 0) result = 8;
+	else
+	{
+		printf("%lu bytes unpacked, %lu bytes patched.\n",(unsigned long)(r.copied + r.patched),(unsigned long)r.patched);
+		printf("Output CRC32: %08lX\n",(unsigned long)r.crc);
+		if (r.crc != r.expected)
+		{
+			printf("Output verification failed, expected: %08lX\n",(unsigned long)r.expected);
+			result = 5;
+		}
+		else if (write_file(NULL, filename_out, out, total, r.crc, unpack_set))
+		{
+			printf("Unable to write: %s\n",filename_out);
+			result = 3;
+		}
+		else *crc_out = r.crc;
+	}
+	free(out);
+	return result;
+}
+
+//
+// Result cache: skips the work when the output of an earlier run is still in place.
+//
+
+// CACHE_FILE in the game's directory has a line for each output written there, with the input's
+// CRC32, size and modification time, a hash of the patch set, and the output's size, time and CRC32.
+// If both files still have the recorded size and time, and the patch set is unchanged, the output
+// is taken as correct after a stat of each file, without reading either one.
+// Replacing or editing either file changes its time, so its entry no longer matches.
+// Times are only kept to the second, so a file with the same time as the cache itself could have
+// been changed just after the entry was written. Those are confirmed by their CRC32 instead.
+// Output from -scan isn't cached, since its patch set can't be known without scanning.
+
+#define CACHE_FILE     "MMPATCH.DAT"
+#define CACHE_VERSION  1
+#define CACHE_ENTRIES  8
+
+typedef struct
+{
+	uint32 crc;      // input CRC32
+	uint32 set;      // cache_set_hash of the patches applied
+	uint32 in_size;
+	long in_time;
+	uint32 out_size;
+	long out_time;
+	uint32 out_crc;
+	char out[13];    // output filename in the same directory
+} cache_entry;
+
+// case insensitive filename comparison
+int name_match(const char* a, const char* b)
+{
+	while (*a && toupper((uint8)*a) == toupper((uint8)*b)) { ++a; ++b; }
+	return *a == *b;
+}
+
+// replaces the filename in path with name, returns 0 if it doesn't fit in FILENAME_MAX
+int sibling_path(char* out, const char* path, const char* name)
+{
+	char* sep;
+
+	if (strlen(path) + strlen(name) >= FILENAME_MAX) return 0;
+	strcpy(out, path);
+	sep = strrchr(out, PATH_SEP);
+	strcpy(sep ? sep+1 : out, name);
+	return 1;
+}
+
+// a CRC32 of every patch address, length and byte, and the options that change the output
+uint32 cache_set_hash(const patch* p)
+{
+	uint8 h[5];
+	uint32 crc = 0xFFFFFFFFUL;
+
+	for (; p->length != 0; ++p)
+	{
+		h[0] = p->addr & 0xFF;
+		h[1] = (p->addr >> 8) & 0xFF;
+		h[2] = p->length & 0xFF;
+		h[3] = (p->length >> 8) & 0xFF;
+		crc = crc32_update(crc,h,4);
+		crc = crc32_update(crc,p->data,p->length);
+	}
+	h[4] = (uint8)unpack;
+	crc = crc32_update(crc,h+4,1);
+	return ~crc;
+}
+
+// reads the cache beside filename_in, returns the number of entries and the time it was written
+int cache_read(const char* filename_in, cache_entry* entries, long* written)
+{
+	FILE* f;
+	struct stat st;
+	char path[FILENAME_MAX];
+	char line[128];
+	cache_entry* e;
+	unsigned long crc, set, in_size, out_size, out_crc;
+	int version, count = 0;
+
+	if (!sibling_path(path, filename_in, CACHE_FILE)) return 0;
+	f = fopen(path,"r");
+	++io_calls;
+	if (f == NULL) return 0;
+	*written = (fstat(fileno(f),&st) == 0) ? (long)st.st_mtime : -1;
+	if (fscanf(f,"MMPATCH %d\n",&version) != 1 || version != CACHE_VERSION)
+	{
+		fclose(f);
+		return 0;
+	}
+	while (count < CACHE_ENTRIES && fgets(line,sizeof(line),f) != NULL)
+	{
+		e = entries + count;
+		if (sscanf(line,"%lx %lx %lu %ld %lu %ld %lx %12s",
+			&crc, &set, &in_size, &e->in_time, &out_size, &e->out_time, &out_crc, e->out) != 8) continue;
+		e->crc = crc;
+		e->set = set;
+		e->in_size = in_size;
+		e->out_size = out_size;
+		e->out_crc = out_crc;
+		++count;
+	}
+	fclose(f);
+	return count;
+}
+
+// returns the build (index into games) if the cache beside filename_in shows its output is up to date,
+// or -1 if it has to be patched, with the input CRC32 in crc
+int cache_lookup(const char* filename_in, uint32* crc)
+{
+	cache_entry entries[CACHE_ENTRIES];
+	struct stat st_in, st_out;
+	char path[FILENAME_MAX];
+	const patch* patches;
+	uint32 check;
+	long written;
+	int i, count, build;
+
+	++io_calls;
+	if (stat(filename_in,&st_in) != 0) return -1;
+	count = cache_read(filename_in, entries, &written);
+	for (i=0; i<count; ++i)
+	{
+		if (entries[i].in_size != (uint32)st_in.st_size || entries[i].in_time != (long)st_in.st_mtime) continue;
+		build = identify(entries[i].crc);
+		patches = game_patches(build);
+		if (patches == NULL) continue;
+		if (!name_match(entries[i].out,games[build].output) || entries[i].set != cache_set_hash(patches)) continue;
+		if (!sibling_path(path, filename_in, games[build].output)) continue;
+		++io_calls;
+		if (stat(path,&st_out) != 0) continue;
+		if (entries[i].out_size != (uint32)st_out.st_size || entries[i].out_time != (long)st_out.st_mtime) continue;
+		if (entries[i].in_time >= written && (!crc32_file(filename_in,&check) || check != entries[i].crc)) continue;
+		if (entries[i].out_time >= written && (!crc32_file(path,&check) || check != entries[i].out_crc)) continue;
+		*crc = entries[i].crc;
+		return build;
+	}
+	return -1;
+}
+
+// records a successful patch in the cache beside filename_in, with the CRC32 of the output written
+void cache_store(const char* filename_in, uint32 crc, const patch* const patches, const char* out, uint32 out_crc)
+{
+	cache_entry entries[CACHE_ENTRIES];
+	cache_entry* e;
+	struct stat st_in, st_out;
+	char path[FILENAME_MAX];
+	FILE* f;
+	long written;
+	int i, count;
+
+	if (!sibling_path(path, filename_in, out)) return;
+	io_calls += 2;
+	if (stat(filename_in,&st_in) != 0 || stat(path,&st_out) != 0) return;
+	count = cache_read(filename_in, entries, &written);
+	for (i=0; i<count && !name_match(entries[i].out,out); ++i);
+	if (i >= CACHE_ENTRIES) // drop the oldest
+	{
+		memmove(entries, entries+1, (CACHE_ENTRIES-1) * sizeof(cache_entry));
+		i = CACHE_ENTRIES - 1;
+	}
+	if (i >= count) count = i + 1;
+	e = entries + i;
+	e->crc = crc;
+	e->set = cache_set_hash(patches);
+	e->in_size = (uint32)st_in.st_size;
+	e->in_time = (long)st_in.st_mtime;
+	e->out_size = (uint32)st_out.st_size;
+	e->out_time = (long)st_out.st_mtime;
+	e->out_crc = out_crc;
+	strncpy(e->out, out, sizeof(e->out) - 1);
+	e->out[sizeof(e->out) - 1] = 0;
+
+	if (!sibling_path(path, filename_in, CACHE_FILE)) return;
+	f = fopen(path,"w");
+	++io_calls;
+	if (f == NULL) return; // a read-only directory just isn't cached
+	fprintf(f,"MMPATCH %d\n",CACHE_VERSION);
+	for (i=0; i<count; ++i)
+	{
+		e = entries + i;
+		fprintf(f,"%08lX %08lX %lu %ld %lu %ld %08lX %s\n",
+			(unsigned long)e->crc, (unsigned long)e->set, (unsigned long)e->in_size, e->in_time,
+			(unsigned long)e->out_size, e->out_time, (unsigned long)e->out_crc, e->out);
+	}
+	fclose(f);
+}
+
+//
+// Batch mode: finds and patches every MM.EXE in a directory tree.
+//
+
+typedef struct
+{
+	char* path;
+	uint32 crc;
+	int sampled; // 1 if rejected by fingerprint, without a CRC32
+	int build;   // index into games, or -1 if unrecognized
+	int cached;  // 1 if the cache showed the output was already up to date
+	int result;  // as returned by patch_run, or 1 if unrecognized
+} batch_job;
+
+batch_job* batch_jobs = NULL;
+int batch_count = 0;
+int batch_capacity = 0;
+
+// adds every MM.EXE in a directory tree to batch_jobs, returns 0 if out of memory
+int batch_find(const char* dir)
+{
+	DIR* d;
+	struct dirent* e;
+	struct stat st;
+	char* path;
+	batch_job* grow;
+	int result = 1;
+
+	d = opendir(dir);
+	if (d == NULL) return 1;
+	while (result && (e = readdir(d)) != NULL)
+	{
+		if (!strcmp(e->d_name,".") || !strcmp(e->d_name,"..")) continue;
+		path = malloc(strlen(dir) + strlen(e->d_name) + 2);
+		if (path == NULL) { result = 0; break; }
+		sprintf(path,"%s%c%s",dir,PATH_SEP,e->d_name);
+#if defined(__unix__)
+		if (lstat(path,&st) != 0) st.st_mode = 0; // symbolic links aren't followed
+#else
+		if (stat(path,&st) != 0) st.st_mode = 0;
+#endif
+		if (S_ISDIR(st.st_mode))
+		{
+			result = batch_find(path);
+			free(path);
+		}
+		else if (S_ISREG(st.st_mode) && name_match(e->d_name,FILE_CRC))
+		{
+			if (batch_count >= batch_capacity)
+			{
+				batch_capacity = batch_capacity ? batch_capacity * 2 : 16;
+				grow = realloc(batch_jobs, batch_capacity * sizeof(batch_job));
+				if (grow == NULL) { free(path); result = 0; break; }
+				batch_jobs = grow;
+			}
+			batch_jobs[batch_count].path = path;
+			batch_jobs[batch_count].crc = 0;
+			batch_jobs[batch_count].sampled = 1;
+			batch_jobs[batch_count].build = -1;
+			batch_jobs[batch_count].cached = 0;
+			batch_jobs[batch_count].result = 1;
+			++batch_count;
+		}
+		else free(path);
+	}
+	closedir(d);
+	return result;
+}
+
+// identifies and patches one job, writing the output next to its input
+void batch_run(batch_job* job)
+{
+	uint8* data;
+	uint32 size;
+	uint32 copied, patched;
+	const patch* patches;
+	const char* out;
+	patch_result r;
+	int result;
+	char filename_out[FILENAME_MAX];
+
+	if (!force && (job->build = cache_lookup(job->path, &job->crc)) >= 0)
+	{
+		job->sampled = 0;
+		job->cached = 1;
+		job->result = 0;
+		return;
+	}
+
+	// most non-matching files are rejected here without reading them fully
+	result = fingerprint(job->path);
+	if (result < 0)
+	{
+		job->result = (result == -2) ? 2 : 1;
+		return;
+	}
+
+	job->sampled = 0;
+	data = load_file(job->path, &size);
+	if (data != NULL)
+	{
+		result = patch_game(data, size, &r);
+		job->crc = r.crc_in;
+		job->build = r.build;
+	}
+	else // too large to load, or unreadable, patched by patch_run instead
+	{
+		if (!crc32_file(job->path, &job->crc))
+		{
+			job->result = 2;
+			return;
+		}
+		job->build = identify(job->crc);
+		result = -1;
+	}
+	if (job->build < 0)
+	{
+		job->result = 1;
+		free(data);
+		return;
+	}
+	patches = game_patches(job->build);
+	out = games[job->build].output;
+
+	job->result = 3;
+	if (sibling_path(filename_out, job->path, out))
+	{
+		job->result = result;
+		if (result == 0) job->result = write_file(job->path, filename_out, data, size, r.crc, patches);
+		if (result < 0)  job->result = patch_run(job->path, filename_out, patches, &copied, &patched);
+		// patch_run doesn't see its output, so its CRC32 is read back for the cache
+		if (job->result == 0 && (result == 0 || crc32_file(filename_out, &r.crc)))
+			cache_store(job->path, job->crc, patches, out, r.crc);
+	}
+	free(data);
+}
+
+#if THREADS
+// Each worker owns a range of the job list, and when it runs out it steals
+// the back half of another worker's remaining range.
+// The main thread reports progress from the done counts, so workers never wait on output.
+// Workers don't print, their errors are returned in each job's result.
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	int next;
+	int end;
+	int done;
+	uint32 io_calls; // set when the worker finishes
+} batch_worker;
+
+batch_worker* batch_workers = NULL;
+int batch_worker_count = 0;
+
+// returns the next job for worker w, or -1 when there is no work left anywhere
+int batch_take(batch_worker* w)
+{
+	batch_worker* v;
+	int i, job, n, end;
+
+	pthread_mutex_lock(&w->lock);
+	job = (w->next < w->end) ? w->next++ : -1;
+	pthread_mutex_unlock(&w->lock);
+	if (job >= 0) return job;
+
+	for (i=1; i<batch_worker_count; ++i)
+	{
+		v = batch_workers + (((w - batch_workers) + i) % batch_worker_count);
+		pthread_mutex_lock(&v->lock);
+		n = v->end - v->next;
+		if (n <= 0)
+		{
+			pthread_mutex_unlock(&v->lock);
+			continue;
+		}
+		end = v->end;
+		v->end = end - ((n + 1) / 2);
+		job = v->end;
+		pthread_mutex_unlock(&v->lock);
+
+		pthread_mutex_lock(&w->lock);
+		w->next = job + 1;
+		w->end = end;
+		pthread_mutex_unlock(&w->lock);
+		return job;
+	}
+	return -1;
+}
+
+void* batch_thread(void* arg)
+{
+	batch_worker* w = (batch_worker*)arg;
+	uint32 start = io_calls;
+	int job;
+
+	while ((job = batch_take(w)) >= 0)
+	{
+		batch_run(batch_jobs + job);
+		pthread_mutex_lock(&w->lock);
+		++w->done;
+		pthread_mutex_unlock(&w->lock);
+	}
+	// moved to w, so it's counted once if this is the main thread
+	w->io_calls = io_calls - start;
+	io_calls = start;
+	return NULL;
+}
+
+// runs all jobs on a pool sized to the number of processors
+void batch_pool()
+{
+	pthread_t* threads;
+	struct timespec wait;
+	long cores;
+	int i, started, done, shown;
+
+	cores = sysconf(_SC_NPROCESSORS_ONLN);
+	batch_worker_count = (cores < 1) ? 1 : (cores > batch_count) ? batch_count : (int)cores;
+	batch_workers = malloc(batch_worker_count * sizeof(batch_worker));
+	threads = malloc(batch_worker_count * sizeof(pthread_t));
+	if (batch_workers == NULL || threads == NULL)
+	{
+		free(batch_workers);
+		free(threads);
+		batch_workers = NULL;
+		for (i=0; i<batch_count; ++i) batch_run(batch_jobs + i);
+		return;
+	}
+	// tables that are otherwise built on first use are built before the workers share them
+	if (!crc_table_ready) crc32_init();
+	if (!games_ready) games_init();
+	for (i=0; i<batch_worker_count; ++i)
+	{
+		pthread_mutex_init(&batch_workers[i].lock, NULL);
+		batch_workers[i].next = (int)(((long)batch_count * i) / batch_worker_count);
+		batch_workers[i].end = (int)(((long)batch_count * (i+1)) / batch_worker_count);
+		batch_workers[i].done = 0;
+		batch_workers[i].io_calls = 0;
+	}
+	// workers that fail to start have their ranges stolen by the others
+	started = 0;
+	for (i=0; i<batch_worker_count; ++i)
+		if (pthread_create(threads + started, NULL, batch_thread, batch_workers + i) == 0) ++started;
+	if (started == 0) batch_thread(batch_workers);
+
+	shown = -1;
+	wait.tv_sec = 0;
+	wait.tv_nsec = 100000000L;
+	while (started > 0)
+	{
+		done = 0;
+		for (i=0; i<batch_worker_count; ++i)
+		{
+			pthread_mutex_lock(&batch_workers[i].lock);
+			done += batch_workers[i].done;
+			pthread_mutex_unlock(&batch_workers[i].lock);
+		}
+		if (done != shown)
+		{
+			printf("\r%d / %d",done,batch_count);
+			fflush(stdout);
+			shown = done;
+		}
+		if (done >= batch_count) break;
+		nanosleep(&wait, NULL);
+	}
+	if (started > 0) printf("\n");
+
+	for (i=0; i<started; ++i) pthread_join(threads[i], NULL);
+	for (i=0; i<batch_worker_count; ++i)
+	{
+		io_calls += batch_workers[i].io_calls;
+		pthread_mutex_destroy(&batch_workers[i].lock);
+	}
+	free(threads);
+	free(batch_workers);
+	batch_workers = NULL;
+}
+#endif
+
+int batch(const char* dir)
+{
+	const char* status[] = {
+		"patched",
+		"unrecognized",
+		"unable to open",
+		"unable to write",
+		"too many patches",
+		"verification failed",
+		"out of memory",
+	};
+	batch_job* job;
+	int i, counts[LENGTH(status)];
+	int mm1 = 0, mm3 = 0, cached = 0;
+
+	printf("Searching %s for " FILE_CRC "...\n", dir);
+	if (!batch_find(dir))
+	{
+		printf("Out of memory.\n");
+		return 6;
+	}
+	printf("%d found.\n", batch_count);
+	if (batch_count == 0) return 0;
+
+#if THREADS
+	batch_pool();
+#else
+	for (i=0; i<batch_count; ++i)
+	{
+		printf("\r%d / %d",i,batch_count);
+		batch_run(batch_jobs + i);
+	}
+	printf("\r%d / %d\n",batch_count,batch_count);
+#endif
+
+	memset(counts, 0, sizeof(counts));
+	for (i=0; i<batch_count; ++i)
+	{
+		job = batch_jobs + i;
+		if (job->result < 0 || job->result >= (int)LENGTH(status)) job->result = 3;
+		if (job->sampled) printf("-------- ");
+		else              printf("%08lX ", (unsigned long)job->crc);
+		printf("%s: %s", job->path, job->cached ? "up to date" : status[job->result]);
+		if (job->build >= 0 && job->result == 0) printf(" (%s)", games[job->build].name);
+		printf("\n");
+		++counts[job->result];
+		if (job->result == 0 && games[job->build].game == 1) ++mm1;
+		if (job->result == 0 && games[job->build].game == 3) ++mm3;
+		cached += job->cached;
+		free(job->path);
+	}
+	printf("\n%d found, %d patched (%d Mega Man, %d Mega Man 3, %d already up to date), %d unrecognized, %d failed.\n",
+		batch_count, counts[0], mm1, mm3, cached, counts[1], batch_count - counts[0] - counts[1]);
+	free(batch_jobs);
+	batch_jobs = NULL;
+	return (counts[0] + counts[1] == batch_count) ? 0 : 3;
+}
+
+//
+// Disk images (-image): patches MM.EXE inside a FAT12 or FAT16 floppy or hard disk image.
+//
+
+// The image may hold a bare volume, or be a partitioned disk, in which case its first FAT12 or
+// FAT16 partition is used. Each MM.EXE in the volume's directory tree is read by following its
+// cluster chain, identified by its CRC32, and patched and verified in memory.
+// The output is written as a new MM1.EXE or MM3.EXE in the same directory, in free clusters.
+// An older one is replaced by writing the new chain and directory entry before its old chain is freed.
+// The new entry is a copy of MM.EXE's, including its time, so rebuilding an image is repeatable.
+// With -inplace only the clusters of MM.EXE holding patched bytes are rewritten instead.
+// Directories aren't extended, so a new file needs a free entry in MM.EXE's directory.
+// One chunk of the first FAT is cached at a time, and written to every copy of the FAT when it is replaced.
+
+#define FAT_CHUNK   512
+#define FAT_ENTRY   32 // directory entry size
+#define FAT_DEPTH   8  // deepest subdirectory searched
+#define FAT_PATH    (FAT_DEPTH * 13 + 1)
+
+typedef struct
+{
+	FILE* f;
+	uint32 fat;          // image offset of the first FAT
+	uint32 fat_size;     // bytes in each copy of the FAT
+	uint fats;
+	uint32 root;         // image offset of the root directory
+	uint root_entries;
+	uint32 data;         // image offset of cluster 2
+	uint32 cluster_size; // bytes in a cluster
+	uint32 clusters;     // last cluster + 1
+	int fat16;
+	long chunk_pos;      // FAT offset of the cached chunk, -1 if none
+	int chunk_dirty;
+	int error;           // 1 if any read or write failed
+	uint8 chunk[FAT_CHUNK];
+} fat_volume;
+
+typedef struct
+{
+	uint32 cluster;      // current cluster, 0 in the root directory
+	uint32 pos;          // image offset of the next entry
+	uint32 left;         // entries left in the root directory or current cluster
+	uint32 steps;        // clusters followed, to stop a chain that loops
+} fat_dir;
+
+uint32 get32(const uint8* p)
+{
+	return get16(p) | ((uint32)get16(p+2) << 16);
+}
+
+void put32(uint8* p, uint32 v)
+{
+	put16(p,(uint)(v & 0xFFFF));
+	put16(p+2,(uint)(v >> 16));
+}
+
+int image_read(fat_volume* v, uint32 pos, void* buf, uint32 length)
+{
+	++io_calls;
+	if (fseek(v->f,(long)pos,SEEK_SET) == 0 && fread(buf,1,(size_t)length,v->f) == length) return 1;
+	v->error = 1;
+	return 0;
+}
+
+int image_write(fat_volume* v, uint32 pos, const void* buf, uint32 length)
+{
+	++io_calls;
+	if (fseek(v->f,(long)pos,SEEK_SET) == 0 && fwrite(buf,1,(size_t)length,v->f) == length) return 1;
+	v->error = 1;
+	return 0;
+}
+
+// writes the cached chunk to every copy of the FAT, if it was changed
+void fat_flush(fat_volume* v)
+{
+	uint32 n;
+	uint i;
+
+	if (!v->chunk_dirty) return;
+	n = v->fat_size - (uint32)v->chunk_pos;
+	if (n > FAT_CHUNK) n = FAT_CHUNK;
+	for (i=0; i<v->fats; ++i)
+		image_write(v, v->fat + (i * v->fat_size) + (uint32)v->chunk_pos, v->chunk, n);
+	v->chunk_dirty = 0;
+}
+
+// returns a byte of the FAT in the cache
+uint8* fat_byte(fat_volume* v, uint32 pos)
+{
+	uint32 start, n;
+
+	start = pos - (pos % FAT_CHUNK);
+	if ((long)start != v->chunk_pos)
+	{
+		fat_flush(v);
+		n = v->fat_size - start;
+		if (n > FAT_CHUNK) n = FAT_CHUNK;
+		memset(v->chunk,0,FAT_CHUNK);
+		image_read(v, v->fat + start, v->chunk, n);
+		v->chunk_pos = (long)start;
+	}
+	return v->chunk + (pos - start);
+}
+
+uint fat_get(fat_volume* v, uint32 n)
+{
+	uint32 pos;
+	uint e;
+
+	pos = v->fat16 ? (n * 2) : (n + (n >> 1));
+	e = *fat_byte(v,pos);
+	e |= (uint)*fat_byte(v,pos+1) << 8;
+	if (v->fat16) return e;
+	return (n & 1) ? (e >> 4) : (e & 0xFFF);
+}
+
+void fat_set(fat_volume* v, uint32 n, uint e)
+{
+	uint32 pos;
+
+	pos = v->fat16 ? (n * 2) : (n + (n >> 1));
+	if (!v->fat16)
+	{
+		if (n & 1) e = (e << 4) | (*fat_byte(v,pos) & 0x0F);
+		else       e = (e & 0xFFF) | ((uint)(*fat_byte(v,pos+1) & 0xF0) << 8);
+	}
+	*fat_byte(v,pos) = e & 0xFF;
+	v->chunk_dirty = 1;
+	*fat_byte(v,pos+1) = (e >> 8) & 0xFF;
+	v->chunk_dirty = 1;
+}
+
+int fat_valid(fat_volume* v, uint32 cluster)
+{
+	return cluster >= 2 && cluster < v->clusters;
+}
+
+uint32 fat_offset(fat_volume* v, uint32 cluster)
+{
+	return v->data + ((cluster - 2) * v->cluster_size);
+}
+
+// checks for a FAT12 or FAT16 BIOS parameter block in a boot sector
+int fat_boot(const uint8* s)
+{
+	uint size = get16(s+11);
+	uint per_cluster = s[13];
+
+	return (s[0] == 0xEB || s[0] == 0xE9) &&
+		(size == 512 || size == 1024 || size == 2048 || size == 4096) &&
+		per_cluster != 0 && (per_cluster & (per_cluster - 1)) == 0 &&
+		get16(s+14) != 0 &&        // reserved sectors
+		s[16] >= 1 && s[16] <= 4 && // FAT copies
+		get16(s+17) != 0 &&        // root directory entries, 0 on FAT32
+		get16(s+22) != 0;          // sectors per FAT, 0 on FAT32
+}
+
+// finds the volume in an image, returns 0 if it isn't FAT12 or FAT16
+int fat_mount(fat_volume* v, FILE* f)
+{
+	uint8 s[512];
+	uint32 base, total, fat_sectors, root_sectors, system, count;
+	uint size, type;
+	int i;
+
+	memset(v,0,sizeof(fat_volume));
+	v->f = f;
+	v->chunk_pos = -1;
+	base = 0;
+	if (!image_read(v,0,s,sizeof(s))) return 0;
+	if (!fat_boot(s))
+	{
+		// a partitioned disk, use its first FAT12 or FAT16 partition
+		if (s[510] != 0x55 || s[511] != 0xAA) return 0;
+		for (i=0; i<4; ++i)
+		{
+			type = s[446 + (i * 16) + 4];
+			if (type == 0x01 || type == 0x04 || type == 0x06 || type == 0x0E) break;
+		}
+		if (i >= 4) return 0;
+		base = get32(s + 446 + (i * 16) + 8) * 512;
+		if (!image_read(v,base,s,sizeof(s)) || !fat_boot(s)) return 0;
+	}
+	size = get16(s+11);
+	v->fats = s[16];
+	v->root_entries = get16(s+17);
+	total = get16(s+19);
+	if (total == 0) total = get32(s+32);
+	fat_sectors = get16(s+22);
+	root_sectors = ((v->root_entries * (uint32)FAT_ENTRY) + size - 1) / size;
+	system = get16(s+14) + (v->fats * fat_sectors) + root_sectors;
+	if (total <= system) return 0;
+	count = (total - system) / s[13];
+	if (count >= 65525) return 0; // FAT32
+	v->fat16 = count >= 4085;
+	v->clusters = count + 2;
+	v->fat = base + ((uint32)get16(s+14) * size);
+	v->fat_size = fat_sectors * size;
+	v->root = v->fat + (v->fats * v->fat_size);
+	v->data = v->root + (root_sectors * size);
+	v->cluster_size = (uint32)s[13] * size;
+	// the FAT must have an entry for every cluster
+	if ((v->fat16 ? (v->clusters * 2) : (v->clusters + (v->clusters >> 1) + 1)) > v->fat_size) return 0;
+	return 1;
+}
+
+void fat_dir_open(fat_volume* v, fat_dir* d, uint32 cluster)
+{
+	d->cluster = cluster;
+	d->steps = 0;
+	if (cluster == 0)
+	{
+		d->pos = v->root;
+		d->left = v->root_entries;
+	}
+	else
+	{
+		d->pos = fat_offset(v,cluster);
+		d->left = v->cluster_size / FAT_ENTRY;
+	}
+}
+
+// reads the next directory entry and its image offset, returns 0 past the last one
+// the entry may be unused, the end of the directory is an entry starting with 0
+int fat_dir_next(fat_volume* v, fat_dir* d, uint8* e, uint32* pos)
+{
+	if (d->cluster != 0 && !fat_valid(v,d->cluster)) return 0;
+	if (d->left == 0)
+	{
+		if (d->cluster == 0 || ++d->steps >= v->clusters) return 0;
+		d->cluster = fat_get(v,d->cluster);
+		if (!fat_valid(v,d->cluster)) return 0;
+		d->pos = fat_offset(v,d->cluster);
+		d->left = v->cluster_size / FAT_ENTRY;
+	}
+	*pos = d->pos;
+	if (!image_read(v,d->pos,e,FAT_ENTRY)) return 0;
+	d->pos += FAT_ENTRY;
+	--d->left;
+	return 1;
+}
+
+// converts a filename to the 11 character form in a directory entry
+void fat_name(uint8* out, const char* name)
+{
+	int i;
+
+	memset(out,' ',11);
+	for (i=0; *name && *name != '.' && i<8; ++name) out[i++] = toupper((uint8)*name);
+	if (*name == '.')
+		for (++name, i=8; *name && i<11; ++name) out[i++] = toupper((uint8)*name);
+}
+
+// reads size bytes of a file from its cluster chain, returns 0 if the chain ends too soon
+int fat_load(fat_volume* v, uint32 cluster, uint8* data, uint32 size)
+{
+	uint32 pos, n;
+
+	for (pos=0; pos<size; pos+=n)
+	{
+		n = size - pos;
+		if (n > v->cluster_size) n = v->cluster_size;
+		if (!fat_valid(v,cluster) || !image_read(v, fat_offset(v,cluster), data+pos, n)) return 0;
+		cluster = fat_get(v,cluster);
+	}
+	return 1;
+}
+
+void fat_free(fat_volume* v, uint32 cluster)
+{
+	uint32 next, steps;
+
+	for (steps=0; fat_valid(v,cluster) && steps<v->clusters; ++steps)
+	{
+		next = fat_get(v,cluster);
+		fat_set(v,cluster,0);
+		cluster = next;
+	}
+}
+
+// allocates a chain of free clusters for size bytes and writes data into it
+// returns the first cluster, 0 for an empty file, or -1 if the volume is full
+long fat_store(fat_volume* v, const uint8* data, uint32 size)
+{
+	uint32 c, first, last, pos, n;
+
+	first = 0;
+	last = 0;
+	pos = 0;
+	for (c=2; c<v->clusters && pos<size; ++c)
+	{
+		if (fat_get(v,c) != 0) continue;
+		fat_set(v, c, v->fat16 ? 0xFFFF : 0xFFF);
+		if (last) fat_set(v,last,(uint)c);
+		else      first = c;
+		last = c;
+		n = size - pos;
+		if (n > v->cluster_size) n = v->cluster_size;
+		image_write(v, fat_offset(v,c), data+pos, n);
+		pos += n;
+	}
+	if (pos < size)
+	{
+		fat_free(v,first);
+		return -1;
+	}
+	return (long)first;
+}
+
+// patches one MM.EXE found at entry e, in the directory starting at cluster dir
+int image_file(fat_volume* v, uint32 dir, const uint8* e, const char* path, const patch** applied)
+{
+	uint8* data;
+	uint8 o[FAT_ENTRY];
+	uint8 name[11];
+	uint32 size, cluster, pos, found, unused;
+	long first;
+	int result;
+	const patch* patches;
+	const patch* p;
+	const char* out;
+	fat_dir d;
+	patch_result r;
+
+	size = get32(e+28);
+	printf("Opening %s\\" FILE_CRC "...\n", path);
+	data = ((uint32)(size_t)size == size) ? malloc(size > 0 ? (size_t)size : 1) : NULL;
+	if (data == NULL)
+	{
+		printf("Out of memory.\n");
+		return 6;
+	}
+	if (!fat_load(v, get16(e+26), data, size))
+	{
+		free(data);
+		printf("Unable to read %s\\" FILE_CRC ", its cluster chain is broken.\n", path);
+		return 2;
+	}
+	stats_phase(PHASE_PATCH);
+	result = patch_game(data, size, &r);
+	stats_phase(-1);
+	printf("CRC32: %08lX\n", (unsigned long)r.crc_in);
+	if (result == 1 || result == 4)
+	{
+		free(data);
+		printf((result == 1) ? "Unrecognized CRC32.\n" : "Too many patches.\n");
+		return result;
+	}
+	patches = r.patches;
+	*applied = patches;
+	out = inplace ? FILE_CRC : games[r.build].output;
+
+	printf("Patching %s\\" FILE_CRC " into %s...\n", path, out);
+	printf("%lu bytes copied, %lu bytes patched.\n",(unsigned long)r.copied,(unsigned long)r.patched);
+	printf("Output CRC32: %08lX\n",(unsigned long)r.crc);
+	if (r.crc != r.expected)
+	{
+		free(data);
+		printf("Output verification failed, expected: %08lX\n",(unsigned long)r.expected);
+		return 5;
+	}
+
+	stats_phase(PHASE_WRITE);
+	if (inplace)
+	{
+		// rewrite each cluster that a patch touches
+		cluster = get16(e+26);
+		for (pos=0; pos<size && fat_valid(v,cluster); pos+=v->cluster_size)
+		{
+			for (p=patches; p->length != 0; ++p)
+				if (p->addr < (pos + v->cluster_size) && ((uint32)p->addr + p->length) > pos) break;
+			if (p->length != 0)
+				image_write(v, fat_offset(v,cluster), data+pos, (size - pos) < v->cluster_size ? (size - pos) : v->cluster_size);
+			cluster = fat_get(v,cluster);
+		}
+		stats_phase(-1);
+		free(data);
+		return 0;
+	}
+
+	// find an existing output to replace, or else a free entry
+	fat_name(name,out);
+	found = 0;
+	unused = 0;
+	fat_dir_open(v,&d,dir);
+	while (fat_dir_next(v,&d,o,&pos))
+	{
+		if (o[0] == 0 || o[0] == 0xE5)
+		{
+			if (!unused) unused = pos;
+			if (o[0] == 0) break;
+		}
+		else if ((o[11] & 0x18) == 0 && !memcmp(o,name,11))
+		{
+			found = pos;
+			break;
+		}
+	}
+	cluster = 0;
+	if (found)
+	{
+		cluster = get16(o+26);
+		unused = found;
+	}
+	if (!unused)
+	{
+		stats_phase(-1);
+		free(data);
+		printf("No free directory entry for %s.\n", out);
+		return 3;
+	}
+	first = fat_store(v, data, size);
+	free(data);
+	if (first < 0)
+	{
+		stats_phase(-1);
+		printf("Not enough free space for %s.\n", out);
+		return 3;
+	}
+	memcpy(o,e,FAT_ENTRY);
+	memcpy(o,name,11);
+	put16(o+20,0);
+	put16(o+26,(uint)first);
+	put32(o+28,size);
+	image_write(v,unused,o,FAT_ENTRY);
+	fat_free(v,cluster);
+	stats_phase(-1);
+	return 0;
+}
+
+// patches every MM.EXE in a directory and its subdirectories, returns the first failure
+// path holds the directory's path, and has room for FAT_PATH characters
+int image_dir(fat_volume* v, uint32 cluster, char* path, int depth, int* found, const patch** applied)
+{
+	fat_dir d;
+	uint8 e[FAT_ENTRY];
+	uint8 mm[11];
+	uint32 pos;
+	size_t length, n;
+	int i, r, result = 0;
+
+	fat_name(mm,FILE_CRC);
+	length = strlen(path);
+	fat_dir_open(v,&d,cluster);
+	while (fat_dir_next(v,&d,e,&pos) && e[0] != 0)
+	{
+		if (e[0] == 0xE5 || (e[11] & 0x08)) continue; // unused, volume label or long filename
+		if (e[11] & 0x10)
+		{
+			if (e[0] == '.' || depth >= FAT_DEPTH) continue;
+			// append the subdirectory name as NAME.EXT
+			path[length] = '\\';
+			for (i=0; i<8 && e[i] != ' '; ++i) path[length+1+i] = e[i];
+			n = length + 1 + i;
+			if (e[8] != ' ')
+			{
+				path[n++] = '.';
+				for (i=8; i<11 && e[i] != ' '; ++i) path[n++] = e[i];
+			}
+			path[n] = 0;
+			r = image_dir(v, get16(e+26), path, depth+1, found, applied);
+			path[length] = 0;
+		}
+		else if (!memcmp(e,mm,11))
+		{
+			++*found;
+			if (*found > 1) printf("\n");
+			r = image_file(v, cluster, e, path, applied);
+		}
+		else continue;
+		if (result == 0) result = r;
+	}
+	return result;
+}
+
+int patch_image(const char* filename, const patch** applied)
+{
+	FILE* f;
+	fat_volume v;
+	char path[FAT_PATH];
+	int found, result;
+
+	stats_phase(PHASE_OPEN);
+	f = fopen(filename,"r+b");
+	++io_calls;
+	stats_phase(-1);
+	if (f == NULL)
+	{
+		printf("Unable to open: %s\n",filename);
+		return 2;
+	}
+	if (!fat_mount(&v,f))
+	{
+		fclose(f);
+		printf("Not a FAT12 or FAT16 disk image: %s\n",filename);
+		return 10;
+	}
+	printf("Searching %s for " FILE_CRC "...\n", filename);
+	path[0] = 0;
+	found = 0;
+	result = image_dir(&v, 0, path, 0, &found, applied);
+	fat_flush(&v);
+	if (fflush(f) != 0) v.error = 1;
+	fclose(f);
+	if (found == 0)
+	{
+		printf(FILE_CRC " not found.\n");
+		return 2;
+	}
+	if (v.error)
+	{
+		printf("Unable to read or write: %s\n",filename);
+		return 3;
+	}
+	return result;
+}
+
+//
+// Frame telemetry (-analyze): reports on the FRAMES_FILE written by a game patched with -telemetry.
+//
+
+#define ANALYZE_BARS   40 // histogram bar length for the most common frame time
+#define ANALYZE_ROWS   20 // most histogram rows, wider ranges are merged
+
+// converts telemetry units to milliseconds
+double frames_ms(uint units)
+{
+	return (units * (double)FRAMES_UNIT * 1000.0) / 1193182.0;
+}
+
+// the time in units that a fraction of the counted times are at or under
+uint frames_percentile(const uint32* counts, uint32 total, double fraction)
+{
+	uint32 rank, sum = 0;
+	uint i;
+
+	rank = (uint32)(fraction * total);
+	if (rank < (fraction * total) || rank < 1) ++rank;
+	for (i=0; i<255; ++i)
+	{
+		sum += counts[i];
+		if (sum >= rank) break;
+	}
+	return i;
+}
+
+int analyze(const char* filename)
+{
+	uint8 data[FRAMES_SIZE];
+	uint32 frame_counts[256];
+	uint32 slow_counts[256];
+	uint32 timed, pauses, dropped, peak, row;
+	uint count, kept, first, lo, hi, width, p50, i, j, t;
+	FILE* f;
+
+	f = fopen(filename,"rb");
+	if (f == NULL)
+	{
+		printf("Unable to open: %s\n",filename);
+		return 2;
+	}
+	i = fread(data,1,FRAMES_SIZE,f);
+	fclose(f);
+	if (i != FRAMES_SIZE || data[0] != 'M' || data[1] != 'M' || data[2] != 'F' || data[3] != 1)
+	{
+		printf("Not a frame telemetry file: %s\n",filename);
+		return 9;
+	}
+
+	// the ring holds the last FRAMES_RING frames, oldest first at count once it has wrapped,
+	// and the very first frame has no earlier one to be timed against
+	count = data[4] | (data[5] << 8);
+	kept = (count < FRAMES_RING) ? count : FRAMES_RING;
+	first = (count <= FRAMES_RING) ? 1 : 0;
+	memset(frame_counts, 0, sizeof(frame_counts));
+	memset(slow_counts, 0, sizeof(slow_counts));
+	timed = pauses = 0;
+	for (i=first; i<kept; ++i)
+	{
+		j = 8 + (2 * ((count + FRAMES_RING - kept + i) & (FRAMES_RING-1)));
+		// 255 is a frame too long to time, most likely the game was paused between stages
+		if (data[j] == 255)
+		{
+			++pauses;
+			continue;
+		}
+		++frame_counts[data[j]];
+		++slow_counts[data[j+1]];
+		++timed;
+	}
+	printf("%s: %u frames, %lu of the last %u timed\n", filename, count, (unsigned long)timed, kept);
+	if (timed == 0) return 0;
+
+	// histogram of frame times
+	for (lo=0; frame_counts[lo] == 0; ++lo);
+	for (hi=254; frame_counts[hi] == 0; --hi);
+	width = ((hi - lo) / ANALYZE_ROWS) + 1;
+	peak = 0;
+	for (i=lo; i<=hi; i+=width)
+	{
+		for (row=0, t=i; t<(i+width) && t<=hi; ++t) row += frame_counts[t];
+		if (row > peak) peak = row;
+	}
+	printf("Frame time:\n");
+	for (i=lo; i<=hi; i+=width)
+	{
+		for (row=0, t=i; t<(i+width) && t<=hi; ++t) row += frame_counts[t];
+		printf("  %6.1f ms %5lu ", frames_ms(i), (unsigned long)row);
+		for (j=0; j<((row * ANALYZE_BARS) + peak - 1) / peak; ++j) printf("#");
+		printf("\n");
+	}
+
+	// a frame taking about n times the usual frame time counts as n-1 dropped
+	p50 = frames_percentile(frame_counts, timed, 0.50);
+	dropped = 0;
+	for (i=p50+1; i<255 && p50>0; ++i)
+	{
+		if ((i * 2) > (p50 * 3)) dropped += frame_counts[i] * (((i + (p50 / 2)) / p50) - 1);
+	}
+	printf("Frame time p50 %.1f ms, p99 %.1f ms\n",
+		frames_ms(p50), frames_ms(frames_percentile(frame_counts, timed, 0.99)));
+	printf("Slowdown time p50 %.1f ms, p99 %.1f ms\n",
+		frames_ms(frames_percentile(slow_counts, timed, 0.50)),
+		frames_ms(frames_percentile(slow_counts, timed, 0.99)));
+	printf("Dropped frames: %lu\n", (unsigned long)dropped);
+	if (pauses > 0) printf("Pauses over %.0f ms: %lu\n", frames_ms(255), (unsigned long)pauses);
+	return 0;
+}
+
+#if BENCH
+//
+// Benchmark: times each patch engine and CRC32 on synthetic executables,
+// so no game files are needed. Results are printed and also written to BENCH_CSV.
+//
+
+#define BENCH_IN     "BENCH.EXE"
+#define BENCH_OUT    "BENCHOUT.EXE"
+#define BENCH_CSV    "MMBENCH.CSV"
+#define BENCH_BYTES  (8UL * 1024UL * 1024UL) // each measurement processes about this much data
+
+uint32 bench_seed = 1;
+patch bench_dense[MAX_PATCHES];
+uint8 bench_data[256];
+
+uint bench_rand()
+{
+	bench_seed = (bench_seed * 1103515245UL) + 12345UL;
+	return (uint)((bench_seed >> 16) & 0x7FFF);
+}
+
+// writes a synthetic MZ executable: a plausible header followed by pseudo-random code
+int bench_make(uint32 size)
+{
+	FILE* f;
+	uint32 pos;
+	uint i, n;
+
+	f = fopen(BENCH_IN,"wb");
+	if (f == NULL) return 0;
+	for (pos=0; pos<size; pos+=n)
+	{
+		n = BLOCK_SIZE;
+		if ((size - pos) < n) n = (uint)(size - pos);
+		for (i=0; i<n; ++i) block[i] = (uint8)bench_rand();
+		if (pos == 0 && n >= 32)
+		{
+			memset(block,0,32);
+			block[0] = 'M';
+			block[1] = 'Z';
+			block[2] = (uint8)(size % 512);             // bytes in last page
+			block[3] = (uint8)((size % 512) >> 8);
+			block[4] = (uint8)((size + 511) / 512);     // pages
+			block[5] = (uint8)(((size + 511) / 512) >> 8);
+			block[8] = 2;                               // header paragraphs
+			block[12] = 0xFF;                           // maximum allocation
+			block[13] = 0xFF;
+			block[24] = 0x1C;                           // relocation table offset
+		}
+		if (fwrite(block,1,n,f) != n) break;
+	}
+	return (fclose(f) == 0) && (pos >= size);
+}
+
+// fills bench_dense with MAX_PATCHES-1 random non-overlapping patches spread over the file,
+// limited to the range a patch address can reach
+void bench_make_dense(uint32 size)
+{
+	uint32 span;
+	uint i;
+
+	if (size > (uint)-1) size = (uint)-1;
+	span = size / (MAX_PATCHES - 1);
+	for (i=0; i<sizeof(bench_data); ++i) bench_data[i] = (uint8)bench_rand();
+	for (i=0; i<(MAX_PATCHES-1); ++i)
+	{
+		bench_dense[i].addr = (uint)((i * span) + (bench_rand() % (span / 2)));
+		bench_dense[i].length = 1 + (bench_rand() % ((span / 2) < 64 ? (uint)(span / 2) : 64));
+		bench_dense[i].data = bench_data + (bench_rand() % 128);
+	}
+	bench_dense[i].addr = 0;
+	bench_dense[i].length = 0;
+	bench_dense[i].data = NULL;
+}
+
+// runs one engine, returns 0 if it could not run
+int bench_engine(const char* engine, const patch* patches)
+{
+	uint8* data;
+	uint32 size, crc;
+	patch_result r;
+
+	if (!strcmp(engine,"crc32"))
+		return crc32(BENCH_IN) != 0;
+	if (!strcmp(engine,"memory"))
+	{
+		engines = 0;
+		data = load_file(BENCH_IN, &size);
+		if (data == NULL) return 0;
+		crc = ~crc32_update(0xFFFFFFFFUL, data, (uint)size);
+		if (patch_buffer(data, size, crc, patches, &r) || r.crc != r.expected ||
+			write_file(BENCH_IN, BENCH_OUT, data, size, r.crc, patches))
+		{
+			free(data);
+			return 0;
+		}
+		free(data);
+		return 1;
+	}
+	engines = 0;
+	if (!strcmp(engine,"mmap"))    engines = ENGINE_MMAP;
+	if (!strcmp(engine,"reflink")) engines = ENGINE_REFLINK;
+	return patch_file(BENCH_IN, BENCH_OUT, patches) == 0;
+}
+
+int bench()
+{
+	const char* engine_names[] = { "crc32", "stdio", "memory",
+#if MMAP
+		"mmap",
+#endif
+#if REFLINK
+		"reflink",
+#endif
+	};
+	const uint32 sizes[] = { 48UL * 1024UL, 4UL * 1024UL * 1024UL };
+	const char* table_names[] = { "mm1", "mm3", "dense" };
+	const patch* tables[] = { mm1_patch, mm3_patch, bench_dense };
+	FILE* csv;
+	uint s, t, e, reps, i;
+	uint32 calls;
+	double start, seconds;
+	int ok;
+
+	csv = fopen(BENCH_CSV,"w");
+	if (csv == NULL)
+	{
+		printf("Unable to open: %s\n",BENCH_CSV);
+		return 3;
+	}
+	fprintf(csv,"engine,table,size,reps,seconds,mb_per_s,ns_per_byte,io_calls\n");
+	printf("%-8s %-6s %9s %10s %10s %9s\n","engine","table","size","MB/s","ns/byte","io calls");
+
+	quiet = 1;
+	for (s=0; s<LENGTH(sizes); ++s)
+	{
+		if (!bench_make(sizes[s]))
+		{
+			printf("Unable to write: %s\n",BENCH_IN);
+			break;
+		}
+		bench_make_dense(sizes[s]);
+		reps = (sizes[s] >= BENCH_BYTES) ? 1 : (uint)(BENCH_BYTES / sizes[s]);
+		for (t=0; t<LENGTH(tables); ++t)
+		for (e=0; e<LENGTH(engine_names); ++e)
+		{
+			if (e == 0 && t > 0) continue; // crc32 doesn't use a patch table
+			calls = io_calls;
+			start = now();
+			ok = 1;
+			for (i=0; i<reps && ok; ++i) ok = bench_engine(engine_names[e], tables[t]);
+			seconds = now() - start;
+			if (!ok)
+			{
+				printf("%-8s %-6s %9lu %10s\n",engine_names[e],table_names[t],(unsigned long)sizes[s],"n/a");
+				continue;
+			}
+			if (seconds <= 0) seconds = 1e-9;
+			calls = (io_calls - calls) / reps;
+			printf("%-8s %-6s %9lu %10.1f %10.3f %9lu\n",
+				engine_names[e], (e == 0) ? "-" : table_names[t], (unsigned long)sizes[s],
+				((double)sizes[s] * reps) / (seconds * 1e6),
+				(seconds * 1e9) / ((double)sizes[s] * reps),
+				(unsigned long)calls);
+			fprintf(csv,"%s,%s,%lu,%u,%.6f,%.3f,%.4f,%lu\n",
+				engine_names[e], (e == 0) ? "-" : table_names[t], (unsigned long)sizes[s], reps, seconds,
+				((double)sizes[s] * reps) / (seconds * 1e6),
+				(seconds * 1e9) / ((double)sizes[s] * reps),
+				(unsigned long)calls);
+		}
+	}
+	quiet = 0;
+	engines = ENGINE_MMAP | ENGINE_REFLINK;
+
+	remove(BENCH_IN);
+	remove(BENCH_OUT);
+	fclose(csv);
+	printf("Results written to " BENCH_CSV "\n");
+	return 0;
+}
+#endif
+
+#if CYCLES
+//
+// Cycle benchmark: runs the injected routines on a small 8086 interpreter with the ports they use
+// stubbed, and counts instructions and estimated cycles on the 8088, 286 and 386.
+//
+
+// The estimates add each instruction form's published base timing, and on the 8088 the effective
+// address time, 4 cycles per word moved over its 8-bit bus, and 2 per segment prefix.
+// The prefetch queue, wait states and DRAM refresh are ignored, so the totals are for comparing
+// variants of a routine rather than predicting its exact time.
+//
+// Every segment shares one 64k block, since the routines only address the game's code segment
+// (and the interrupt table, which lands harmlessly at the bottom of the block).
+// Ports are scripted by how many times they are read, so each processor follows the same path:
+// 03DAh is in vertical retrace for the last CYCLES_RETRACE of every CYCLES_FRAME reads,
+// the 0201h joystick axes stay set for CYCLES_JOY_X and CYCLES_JOY_Y reads after a write,
+// and PIT channel 0 counts down CYCLES_PIT_STEP for each latch.
+// A call into game code outside the patches returns at once, and is counted as a call and return.
+// A jump out of the patches, or a return to the starting stack, ends the routine.
+
+#define CYCLES_FRAME     240
+#define CYCLES_RETRACE   16
+#define CYCLES_JOY_X     60
+#define CYCLES_JOY_Y     90
+#define CYCLES_PIT_STEP  40
+#define CYCLES_RETURN    0xFFFE // return address that ends a routine
+#define CYCLES_LIMIT     10000000UL
+
+enum { CPU_8088, CPU_286, CPU_386, CPU_COUNT };
+const char* const cpu_names[CPU_COUNT] = { "8088", "286", "386" };
+
+// instruction timing classes: 8088, 286, 386 base cycles
+enum
+{
+	T_MOV_RR, T_ALU_RR, T_MOV_RI, T_ALU_RI, T_MOV_RM, T_MOV_MR, T_MOV_MI, T_MOV_AM, T_MOV_MA,
+	T_ALU_RM, T_ALU_MR, T_ALU_MI, T_CMP_MI, T_TEST_MI, T_TEST_RM, T_INC_R, T_INC_M,
+	T_SHIFT_R, T_SHIFT_M, T_SHIFT_CL, T_XCHG_AX, T_XCHG_RR, T_XCHG_RM, T_LEA, T_MOV_SR,
+	T_PUSH, T_POP, T_PUSH_S, T_POP_S, T_PUSHF, T_POPF, T_IN_DX, T_OUT_DX, T_IN_IMM, T_OUT_IMM,
+	T_JCC, T_JCC_T, T_JMP, T_CALL, T_CALL_M, T_JMP_M, T_RET, T_LOOP, T_LOOP_T, T_LOOPZ_T,
+	T_JCXZ, T_JCXZ_T, T_FLAG, T_HLT, T_CBW, T_CWD, T_NOT_R, T_NOT_M, T_MUL, T_NOP,
+	T_COUNT
+};
+const uint8 cpu_timing[T_COUNT][CPU_COUNT] = {
+	{  2,  2,  2 }, {  3,  2,  2 }, {  4,  2,  2 }, {  4,  3,  2 }, {  8,  5,  4 }, {  9,  3,  2 },
+	{ 10,  3,  2 }, { 10,  5,  4 }, { 10,  3,  2 }, {  9,  7,  6 }, { 16,  7,  7 }, { 17,  7,  7 },
+	{ 10,  6,  5 }, { 11,  6,  5 }, {  9,  6,  5 }, {  2,  2,  2 }, { 15,  7,  6 }, {  2,  2,  3 },
+	{ 15,  7,  7 }, {  8,  5,  3 }, {  3,  3,  3 }, {  4,  3,  3 }, { 17,  5,  5 }, {  2,  3,  2 },
+	{  2,  2,  2 }, { 15,  3,  2 }, { 12,  5,  4 }, { 14,  3,  2 }, { 12,  5,  7 }, { 14,  3,  4 },
+	{ 12,  5,  5 }, {  8,  5, 13 }, {  8,  3, 11 }, { 10,  5, 12 }, { 10,  3, 10 }, {  4,  3,  3 },
+	{ 16,  7,  7 }, { 15,  7,  7 }, { 23,  7,  7 }, { 29, 11, 10 }, { 18, 11, 10 }, { 20, 11, 10 },
+	{  5,  4, 11 }, { 17,  8, 11 }, { 19,  8, 11 }, {  6,  4,  5 }, { 18,  8,  9 }, {  2,  2,  3 },
+	{  2,  2,  5 }, {  2,  2,  3 }, {  5,  2,  2 }, {  3,  2,  2 }, { 16,  7,  6 }, {118, 21, 22 },
+	{  3,  3,  3 },
+};
+
+#define F_CF  0x0001
+#define F_PF  0x0004
+#define F_ZF  0x0040
+#define F_SF  0x0080
+#define F_IF  0x0200
+#define F_DF  0x0400
+#define F_OF  0x0800
+
+typedef struct
+{
+	uint16 r[8];    // ax, cx, dx, bx, sp, bp, si, di
+	uint16 s[4];    // es, cs, ss, ds
+	uint16 ip;
+	uint16 flags;
+	uint32 count;   // instructions executed
+	uint32 cycles[CPU_COUNT];
+	uint32 reads;   // port reads
+	uint32 calls;   // calls to game code outside the patches
+	uint32 halts;
+	int prefix;     // segment prefixes on the current instruction
+	int done;       // 1 returned, 2 jumped out of the patches, -1 unsupported instruction
+	// port scripts
+	uint32 retrace;
+	uint joy;
+	uint16 pit;
+	uint16 pit_latch;
+	int pit_high;
+	// memory written at each HLT, for a routine that waits on an interrupt
+	uint halt_addr;
+	uint8 halt_value;
+} cpu_state;
+
+typedef struct
+{
+	int mem;
+	uint reg, rm;
+	uint16 ea;
+	uint ea_cycles;
+} cpu_modrm;
+
+uint8* cpu_mem = NULL;
+uint8 cpu_loaded[0x10000 / 8]; // 1 bit for each byte holding patch data
+
+int cpu_is_loaded(uint16 a)
+{
+	return (cpu_loaded[a >> 3] >> (a & 7)) & 1;
+}
+
+void cpu_load(const patch* p, long delta, uint first, uint last)
+{
+	uint j;
+	uint16 a;
+
+	for (; p->length != 0; ++p)
+	{
+		if (p->addr < first || p->addr >= last) continue;
+		for (j=0; j<p->length; ++j)
+		{
+			a = (uint16)((long)p->addr + delta + j);
+			cpu_mem[a] = p->data[j];
+			cpu_loaded[a >> 3] |= 1 << (a & 7);
+		}
+	}
+}
+
+void cpu_tick(cpu_state* c, int t, uint ea, uint words)
+{
+	c->cycles[CPU_8088] += cpu_timing[t][CPU_8088] + ea + (words * 4) + (c->prefix * 2);
+	c->cycles[CPU_286]  += cpu_timing[t][CPU_286];
+	c->cycles[CPU_386]  += cpu_timing[t][CPU_386];
+}
+
+uint8 cpu_fetch8(cpu_state* c)
+{
+	return cpu_mem[c->ip++];
+}
+
+uint16 cpu_fetch16(cpu_state* c)
+{
+	uint16 v = cpu_mem[c->ip] | (cpu_mem[(uint16)(c->ip+1)] << 8);
+	c->ip += 2;
+	return v;
+}
+
+uint cpu_read(uint16 a, int word)
+{
+	if (!word) return cpu_mem[a];
+	return cpu_mem[a] | (cpu_mem[(uint16)(a+1)] << 8);
+}
+
+void cpu_write(uint16 a, int word, uint v)
+{
+	cpu_mem[a] = v & 0xFF;
+	if (word) cpu_mem[(uint16)(a+1)] = (v >> 8) & 0xFF;
+}
+
+uint cpu_reg(cpu_state* c, uint n, int word)
+{
+	if (word) return c->r[n];
+	return (n < 4) ? (c->r[n] & 0xFF) : (c->r[n-4] >> 8);
+}
+
+void cpu_set_reg(cpu_state* c, uint n, int word, uint v)
+{
+	if (word)       c->r[n] = (uint16)v;
+	else if (n < 4) c->r[n] = (c->r[n] & 0xFF00) | (v & 0xFF);
+	else            c->r[n-4] = (c->r[n-4] & 0x00FF) | ((v & 0xFF) << 8);
+}
+
+void cpu_decode(cpu_state* c, cpu_modrm* m)
+{
+	uint8 b = cpu_fetch8(c);
+	uint mod = b >> 6;
+	static const uint8 ea_base[8] = { 7, 8, 8, 7, 5, 5, 5, 5 };
+
+	m->reg = (b >> 3) & 7;
+	m->rm = b & 7;
+	m->mem = (mod != 3);
+	m->ea_cycles = 0;
+	if (!m->mem) return;
+	if (mod == 0 && m->rm == 6)
+	{
+		m->ea = cpu_fetch16(c);
+		m->ea_cycles = 6;
+		return;
+	}
+	switch (m->rm)
+	{
+		case 0: m->ea = c->r[3] + c->r[6]; break;
+		case 1: m->ea = c->r[3] + c->r[7]; break;
+		case 2: m->ea = c->r[5] + c->r[6]; break;
+		case 3: m->ea = c->r[5] + c->r[7]; break;
+		case 4: m->ea = c->r[6]; break;
+		case 5: m->ea = c->r[7]; break;
+		case 6: m->ea = c->r[5]; break;
+		default: m->ea = c->r[3]; break;
+	}
+	m->ea_cycles = ea_base[m->rm];
+	if (mod == 1) m->ea += (uint16)(int16_t)(int8_t)cpu_fetch8(c);
+	if (mod == 2) m->ea += cpu_fetch16(c);
+	if (mod != 0) m->ea_cycles += 4;
+}
+
+uint cpu_get(cpu_state* c, cpu_modrm* m, int word)
+{
+	return m->mem ? cpu_read(m->ea, word) : cpu_reg(c, m->rm, word);
+}
+
+void cpu_set(cpu_state* c, cpu_modrm* m, int word, uint v)
+{
+	if (m->mem) cpu_write(m->ea, word, v);
+	else        cpu_set_reg(c, m->rm, word, v);
+}
+
+void cpu_push(cpu_state* c, uint v)
+{
+	c->r[4] -= 2;
+	cpu_write(c->r[4], 1, v);
+}
+
+uint cpu_pop(cpu_state* c)
+{
+	uint v = cpu_read(c->r[4], 1);
+	c->r[4] += 2;
+	return v;
+}
+
+// sets ZF, SF and PF from a result
+void cpu_szp(cpu_state* c, uint v, int word)
+{
+	uint p;
+
+	v &= word ? 0xFFFF : 0xFF;
+	c->flags &= ~(F_ZF | F_SF | F_PF);
+	if (v == 0) c->flags |= F_ZF;
+	if (v & (word ? 0x8000 : 0x80)) c->flags |= F_SF;
+	p = v & 0xFF;
+	p ^= p >> 4;
+	p ^= p >> 2;
+	p ^= p >> 1;
+	if (!(p & 1)) c->flags |= F_PF;
+}
+
+// add, or, adc, sbb, and, sub, xor, cmp
+uint cpu_alu(cpu_state* c, uint op, uint a, uint b, int word)
+{
+	uint32 mask = word ? 0xFFFF : 0xFF;
+	uint32 sign = word ? 0x8000 : 0x80;
+	uint32 r, carry;
+
+	carry = (op == 2 || op == 3) ? (c->flags & F_CF) : 0;
+	switch (op)
+	{
+		case 0: case 2: r = (uint32)a + b + carry; break;
+		case 3: case 5: case 7: r = (uint32)a - b - carry; break;
+		case 1: r = a | b; break;
+		case 4: r = a & b; break;
+		default: r = a ^ b; break;
+	}
+	c->flags &= ~(F_CF | F_OF);
+	if (op == 0 || op == 2)
+	{
+		if (r > mask) c->flags |= F_CF;
+		if (~(a ^ b) & (a ^ r) & sign) c->flags |= F_OF;
+	}
+	else if (op == 3 || op == 5 || op == 7)
+	{
+		if ((uint32)a < (uint32)b + carry) c->flags |= F_CF;
+		if ((a ^ b) & (a ^ r) & sign) c->flags |= F_OF;
+	}
+	cpu_szp(c, (uint)r, word);
+	return (uint)(r & mask);
+}
+
+uint cpu_inc(cpu_state* c, uint v, int dec, int word)
+{
+	uint cf = c->flags & F_CF;
+	v = cpu_alu(c, dec ? 5 : 0, v, 1, word);
+	c->flags = (c->flags & ~F_CF) | cf;
+	return v;
+}
+
+// rol, ror, rcl, rcr, shl, shr, sal, sar
+uint cpu_shift(cpu_state* c, uint op, uint v, uint n, int word)
+{
+	uint32 mask = word ? 0xFFFF : 0xFF;
+	uint32 sign = word ? 0x8000 : 0x80;
+	uint cf;
+
+	for (; n > 0; --n)
+	{
+		switch (op)
+		{
+			case 0: cf = (v & sign) != 0; v = ((v << 1) | cf) & mask; break;
+			case 1: cf = v & 1; v = (v >> 1) | (cf ? sign : 0); break;
+			case 2: cf = (v & sign) != 0; v = ((v << 1) | (c->flags & F_CF)) & mask; break;
+			case 3: cf = v & 1; v = (v >> 1) | ((c->flags & F_CF) ? sign : 0); break;
+			case 5: cf = v & 1; v >>= 1; break;
+			case 7: cf = v & 1; v = (v >> 1) | (v & sign); break;
+			default: cf = (v & sign) != 0; v = (v << 1) & mask; break;
+		}
+		c->flags = (c->flags & ~F_CF) | (cf ? F_CF : 0);
+		if (op >= 4) cpu_szp(c, v, word);
+	}
+	return v;
+}
+
+uint cpu_in(cpu_state* c, uint port)
+{
+	uint v;
+
+	++c->reads;
+	switch (port)
+	{
+		case 0x3DA:
+			v = ((c->retrace++ % CYCLES_FRAME) >= (CYCLES_FRAME - CYCLES_RETRACE)) ? 0x08 : 0x00;
+			return v;
+		case 0x201:
+			v = 0xF0;
+			if (c->joy < CYCLES_JOY_X) v |= 1;
+			if (c->joy < CYCLES_JOY_Y) v |= 2;
+			++c->joy;
+			return v;
+		case 0x40:
+			v = c->pit_high ? (c->pit_latch >> 8) : (c->pit_latch & 0xFF);
+			c->pit_high ^= 1;
+			return v;
+		default:
+			return 0xFF;
+	}
+}
+
+void cpu_out(cpu_state* c, uint port, uint v)
+{
+	if (port == 0x201) c->joy = 0;
+	if (port == 0x43 && (v & 0xF0) == 0)
+	{
+		c->pit -= CYCLES_PIT_STEP;
+		c->pit_latch = c->pit;
+		c->pit_high = 0;
+	}
+}
+
+int cpu_condition(cpu_state* c, uint cc)
+{
+	uint f = c->flags;
+	int r;
+
+	switch (cc >> 1)
+	{
+		case 0: r = (f & F_OF) != 0; break;
+		case 1: r = (f & F_CF) != 0; break;
+		case 2: r = (f & F_ZF) != 0; break;
+		case 3: r = (f & (F_CF | F_ZF)) != 0; break;
+		case 4: r = (f & F_SF) != 0; break;
+		case 5: r = (f & F_PF) != 0; break;
+		case 6: r = ((f & F_SF) != 0) != ((f & F_OF) != 0); break;
+		default: r = (f & F_ZF) || (((f & F_SF) != 0) != ((f & F_OF) != 0)); break;
+	}
+	return (cc & 1) ? !r : r;
+}
+
+// a near call into the patches is followed, one into the game returns at once
+void cpu_call(cpu_state* c, uint16 target)
+{
+	if (cpu_is_loaded(target))
+	{
+		cpu_push(c, c->ip);
+		c->ip = target;
+		return;
+	}
+	++c->calls;
+	cpu_tick(c, T_RET, 0, 0);
+}
+
+// executes one instruction
+void cpu_step(cpu_state* c)
+{
+	cpu_modrm m;
+	uint8 op;
+	uint a, b, v;
+	int word, taken;
+	uint16 target;
+
+	c->prefix = 0;
+	op = cpu_fetch8(c);
+	while (op == 0x26 || op == 0x2E || op == 0x36 || op == 0x3E)
+	{
+		++c->prefix;
+		op = cpu_fetch8(c);
+	}
+	++c->count;
+	word = op & 1;
+
+	if (op < 0x40 && (op & 7) < 6) // alu
+	{
+		a = (op >> 3) & 7;
+		switch (op & 7)
+		{
+			case 0: case 1:
+				cpu_decode(c, &m);
+				v = cpu_alu(c, a, cpu_get(c, &m, word), cpu_reg(c, m.reg, word), word);
+				if (a != 7) cpu_set(c, &m, word, v);
+				if (m.mem) cpu_tick(c, a == 7 ? T_ALU_RM : T_ALU_MR, m.ea_cycles, word * (a == 7 ? 1 : 2));
+				else       cpu_tick(c, T_ALU_RR, 0, 0);
+				return;
+			case 2: case 3:
+				cpu_decode(c, &m);
+				v = cpu_alu(c, a, cpu_reg(c, m.reg, word), cpu_get(c, &m, word), word);
+				if (a != 7) cpu_set_reg(c, m.reg, word, v);
+				if (m.mem) cpu_tick(c, T_ALU_RM, m.ea_cycles, word);
+				else       cpu_tick(c, T_ALU_RR, 0, 0);
+				return;
+			default:
+				b = word ? cpu_fetch16(c) : cpu_fetch8(c);
+				v = cpu_alu(c, a, cpu_reg(c, 0, word), b, word);
+				if (a != 7) cpu_set_reg(c, 0, word, v);
+				cpu_tick(c, T_ALU_RI, 0, 0);
+				return;
+		}
+	}
+	if (op < 0x20 && (op & 7) >= 6) // push/pop segment
+	{
+		if (op & 1) c->s[op >> 3] = cpu_pop(c);
+		else        cpu_push(c, c->s[op >> 3]);
+		cpu_tick(c, (op & 1) ? T_POP_S : T_PUSH_S, 0, 0);
+		return;
+	}
+	if (op >= 0x40 && op < 0x50)
+	{
+		c->r[op & 7] = cpu_inc(c, c->r[op & 7], op & 8, 1);
+		cpu_tick(c, T_INC_R, 0, 0);
+		return;
+	}
+	if (op >= 0x50 && op < 0x58)
+	{
+		v = c->r[op & 7];
+		cpu_push(c, v);
+		cpu_tick(c, T_PUSH, 0, 0);
+		return;
+	}
+	if (op >= 0x58 && op < 0x60)
+	{
+		c->r[op & 7] = cpu_pop(c);
+		cpu_tick(c, T_POP, 0, 0);
+		return;
+	}
+	if (op >= 0x70 && op < 0x80)
+	{
+		target = c->ip + 1 + (int8_t)cpu_fetch8(c);
+		taken = cpu_condition(c, op & 15);
+		if (taken) c->ip = target;
+		cpu_tick(c, taken ? T_JCC_T : T_JCC, 0, 0);
+		return;
+	}
+	if (op >= 0x90 && op < 0x98)
+	{
+		v = c->r[0];
+		c->r[0] = c->r[op & 7];
+		c->r[op & 7] = v;
+		cpu_tick(c, op == 0x90 ? T_NOP : T_XCHG_AX, 0, 0);
+		return;
+	}
+	if (op >= 0xB0 && op < 0xC0)
+	{
+		word = (op & 8) != 0;
+		cpu_set_reg(c, op & 7, word, word ? cpu_fetch16(c) : cpu_fetch8(c));
+		cpu_tick(c, T_MOV_RI, 0, 0);
+		return;
+	}
+	switch (op)
+	{
+		case 0x80: case 0x81: case 0x83:
+			cpu_decode(c, &m);
+			b = (op == 0x81) ? cpu_fetch16(c) : cpu_fetch8(c);
+			if (op == 0x83) b = (uint16)(int16_t)(int8_t)b;
+			v = cpu_alu(c, m.reg, cpu_get(c, &m, word), b, word);
+			if (m.reg != 7) cpu_set(c, &m, word, v);
+			if (!m.mem)          cpu_tick(c, T_ALU_RI, 0, 0);
+			else if (m.reg == 7) cpu_tick(c, T_CMP_MI, m.ea_cycles, word);
+			else                 cpu_tick(c, T_ALU_MI, m.ea_cycles, word * 2);
+			return;
+		case 0x84: case 0x85:
+			cpu_decode(c, &m);
+			cpu_alu(c, 4, cpu_get(c, &m, word), cpu_reg(c, m.reg, word), word);
+			cpu_tick(c, m.mem ? T_TEST_RM : T_ALU_RR, m.ea_cycles, m.mem ? word : 0);
+			return;
+		case 0x86: case 0x87:
+			cpu_decode(c, &m);
+			v = cpu_get(c, &m, word);
+			cpu_set(c, &m, word, cpu_reg(c, m.reg, word));
+			cpu_set_reg(c, m.reg, word, v);
+			cpu_tick(c, m.mem ? T_XCHG_RM : T_XCHG_RR, m.ea_cycles, m.mem ? word * 2 : 0);
+			return;
+		case 0x88: case 0x89:
+			cpu_decode(c, &m);
+			cpu_set(c, &m, word, cpu_reg(c, m.reg, word));
+			cpu_tick(c, m.mem ? T_MOV_MR : T_MOV_RR, m.ea_cycles, m.mem ? word : 0);
+			return;
+		case 0x8A: case 0x8B:
+			cpu_decode(c, &m);
+			cpu_set_reg(c, m.reg, word, cpu_get(c, &m, word));
+			cpu_tick(c, m.mem ? T_MOV_RM : T_MOV_RR, m.ea_cycles, m.mem ? word : 0);
+			return;
+		case 0x8C:
+			cpu_decode(c, &m);
+			cpu_set(c, &m, 1, c->s[m.reg & 3]);
+			cpu_tick(c, m.mem ? T_MOV_MR : T_MOV_SR, m.ea_cycles, m.mem);
+			return;
+		case 0x8D:
+			cpu_decode(c, &m);
+			cpu_set_reg(c, m.reg, 1, m.ea);
+			cpu_tick(c, T_LEA, m.ea_cycles, 0);
+			return;
+		case 0x8E:
+			cpu_decode(c, &m);
+			c->s[m.reg & 3] = cpu_get(c, &m, 1);
+			cpu_tick(c, m.mem ? T_MOV_RM : T_MOV_SR, m.ea_cycles, m.mem);
+			return;
+		case 0x98:
+			c->r[0] = (uint16)(int16_t)(int8_t)(c->r[0] & 0xFF);
+			cpu_tick(c, T_CBW, 0, 0);
+			return;
+		case 0x99:
+			c->r[2] = (c->r[0] & 0x8000) ? 0xFFFF : 0;
+			cpu_tick(c, T_CWD, 0, 0);
+			return;
+		case 0x9C:
+			cpu_push(c, c->flags);
+			cpu_tick(c, T_PUSHF, 0, 0);
+			return;
+		case 0x9D:
+			c->flags = cpu_pop(c);
+			cpu_tick(c, T_POPF, 0, 0);
+			return;
+		case 0xA0: case 0xA1:
+			cpu_set_reg(c, 0, word, cpu_read(cpu_fetch16(c), word));
+			cpu_tick(c, T_MOV_AM, 0, word);
+			return;
+		case 0xA2: case 0xA3:
+			cpu_write(cpu_fetch16(c), word, cpu_reg(c, 0, word));
+			cpu_tick(c, T_MOV_MA, 0, word);
+			return;
+		case 0xA8: case 0xA9:
+			cpu_alu(c, 4, cpu_reg(c, 0, word), word ? cpu_fetch16(c) : cpu_fetch8(c), word);
+			cpu_tick(c, T_ALU_RI, 0, 0);
+			return;
+		case 0xC3:
+			c->ip = cpu_pop(c);
+			cpu_tick(c, T_RET, 0, 0);
+			return;
+		case 0xC6: case 0xC7:
+			cpu_decode(c, &m);
+			cpu_set(c, &m, word, word ? cpu_fetch16(c) : cpu_fetch8(c));
+			cpu_tick(c, m.mem ? T_MOV_MI : T_MOV_RI, m.ea_cycles, m.mem ? word : 0);
+			return;
+		case 0xD0: case 0xD1: case 0xD2: case 0xD3:
+			cpu_decode(c, &m);
+			b = (op & 2) ? (c->r[1] & 0xFF) : 1;
+			cpu_set(c, &m, word, cpu_shift(c, m.reg, cpu_get(c, &m, word), b, word));
+			if (m.mem)       cpu_tick(c, T_SHIFT_M, m.ea_cycles, word * 2);
+			else if (op & 2) cpu_tick(c, T_SHIFT_CL, 0, 0);
+			else             cpu_tick(c, T_SHIFT_R, 0, 0);
+			return;
+		case 0xE0: case 0xE1: case 0xE2:
+			target = c->ip + 1 + (int8_t)cpu_fetch8(c);
+			--c->r[1];
+			taken = (c->r[1] != 0);
+			if (op == 0xE0) taken = taken && !(c->flags & F_ZF);
+			if (op == 0xE1) taken = taken && (c->flags & F_ZF);
+			if (taken) c->ip = target;
+			cpu_tick(c, taken ? (op == 0xE2 ? T_LOOP_T : T_LOOPZ_T) : T_LOOP, 0, 0);
+			return;
+		case 0xE3:
+			target = c->ip + 1 + (int8_t)cpu_fetch8(c);
+			taken = (c->r[1] == 0);
+			if (taken) c->ip = target;
+			cpu_tick(c, taken ? T_JCXZ_T : T_JCXZ, 0, 0);
+			return;
+		case 0xE4: case 0xE5:
+			cpu_set_reg(c, 0, word, cpu_in(c, cpu_fetch8(c)));
+			cpu_tick(c, T_IN_IMM, 0, 0);
+			return;
+		case 0xE6: case 0xE7:
+			cpu_out(c, cpu_fetch8(c), c->r[0] & 0xFF);
+			cpu_tick(c, T_OUT_IMM, 0, 0);
+			return;
+		case 0xE8:
+			target = cpu_fetch16(c);
+			target += c->ip;
+			cpu_tick(c, T_CALL, 0, 0);
+			cpu_call(c, target);
+			return;
+		case 0xE9:
+			target = cpu_fetch16(c);
+			c->ip += target;
+			cpu_tick(c, T_JMP, 0, 0);
+			return;
+		case 0xEB:
+			target = c->ip + 1 + (int8_t)cpu_fetch8(c);
+			c->ip = target;
+			cpu_tick(c, T_JMP, 0, 0);
+			return;
+		case 0xEC: case 0xED:
+			cpu_set_reg(c, 0, word, cpu_in(c, c->r[2]));
+			cpu_tick(c, T_IN_DX, 0, 0);
+			return;
+		case 0xEE: case 0xEF:
+			cpu_out(c, c->r[2], c->r[0] & 0xFF);
+			cpu_tick(c, T_OUT_DX, 0, 0);
+			return;
+		case 0xF4:
+			++c->halts;
+			if (c->halt_addr != 0) cpu_mem[c->halt_addr] = c->halt_value;
+			cpu_tick(c, T_HLT, 0, 0);
+			return;
+		case 0xF6: case 0xF7:
+			cpu_decode(c, &m);
+			v = cpu_get(c, &m, word);
+			switch (m.reg)
+			{
+				case 0:
+					cpu_alu(c, 4, v, word ? cpu_fetch16(c) : cpu_fetch8(c), word);
+					cpu_tick(c, m.mem ? T_TEST_MI : T_ALU_RI, m.ea_cycles, m.mem ? word : 0);
+					return;
+				case 2:
+					cpu_set(c, &m, word, ~v);
+					cpu_tick(c, m.mem ? T_NOT_M : T_NOT_R, m.ea_cycles, m.mem ? word * 2 : 0);
+					return;
+				case 3:
+					cpu_set(c, &m, word, cpu_alu(c, 5, 0, v, word));
+					cpu_tick(c, m.mem ? T_NOT_M : T_NOT_R, m.ea_cycles, m.mem ? word * 2 : 0);
+					return;
+				case 4:
+					if (word)
+					{
+						v = (uint32)c->r[0] * v;
+						c->r[0] = v & 0xFFFF;
+						c->r[2] = (uint32)v >> 16;
+					}
+					else c->r[0] = (c->r[0] & 0xFF) * v;
+					cpu_tick(c, T_MUL, m.ea_cycles, m.mem ? word : 0);
+					return;
+			}
+			break;
+		case 0xF8: case 0xF9: case 0xFA: case 0xFB: case 0xFC: case 0xFD:
+			if (op == 0xF8) c->flags &= ~F_CF;
+			if (op == 0xF9) c->flags |= F_CF;
+			if (op == 0xFA) c->flags &= ~F_IF;
+			if (op == 0xFB) c->flags |= F_IF;
+			if (op == 0xFC) c->flags &= ~F_DF;
+			if (op == 0xFD) c->flags |= F_DF;
+			cpu_tick(c, T_FLAG, 0, 0);
+			return;
+		case 0xFE: case 0xFF:
+			cpu_decode(c, &m);
+			switch (m.reg)
+			{
+				case 0: case 1:
+					cpu_set(c, &m, word, cpu_inc(c, cpu_get(c, &m, word), m.reg, word));
+					cpu_tick(c, m.mem ? T_INC_M : T_INC_R, m.ea_cycles, m.mem ? word * 2 : 0);
+					return;
+				case 2:
+					if (!word) break;
+					cpu_tick(c, T_CALL_M, m.ea_cycles, m.mem);
+					cpu_call(c, cpu_get(c, &m, 1));
+					return;
+				case 4:
+					if (!word) break;
+					c->ip = cpu_get(c, &m, 1);
+					cpu_tick(c, T_JMP_M, m.ea_cycles, m.mem);
+					return;
+				case 5: // far jump, out of the routine
+					cpu_tick(c, T_JMP_M, m.ea_cycles, m.mem * 2);
+					c->done = 2;
+					return;
+				case 6:
+					if (!word) break;
+					cpu_push(c, cpu_get(c, &m, 1));
+					cpu_tick(c, T_PUSH, m.ea_cycles, m.mem);
+					return;
+			}
+			break;
+	}
+	printf("Unsupported instruction %02X at %04X\n", op, (uint)(uint16)(c->ip - 1));
+	c->done = -1;
+}
+
+// a routine to time and how to start it
+typedef struct
+{
+	const char* name;
+	uint addr;
+	uint dx;
+	uint halt_addr; // see cpu_state
+	uint8 halt_value;
+} cycles_test;
+
+const cycles_test cycles_mm1[] = {
+	{ "mm1_slow",          mm1_slow_addr,       0,      0,      0    },
+	{ "mm1_vsync",         mm1_vsync_addr,      0,      0,      0    },
+	{ "mm1_settings",      mm1_settings_addr,   0,      0,      0    },
+	{ "mm1_joy poll",      mm1_joy_addr+8,      0x0201, 0,      0    },
+	{ "mm1_joy calibrate", mm1_joy_addr+72,     0x0201, 0,      0    },
+	{ "mm1_joy read",      mm1_joy_addr+141,    0x0201, 0,      0    },
+	{ "mm1_select",        mm1_select_addr+1,   0,      0,      0    },
+	{ "mm1_mans keyboard", mm1_mans_addr,       0,      0x1205, 0xB9 },
+	{ NULL, 0, 0, 0, 0 }
+};
+const cycles_test cycles_mm3[] = {
+	{ "mm3_slow",          mm3_slow_addr,       0,      0,      0    },
+	{ "mm3_vsync",         mm3_vsync_addr,      0,      0,      0    },
+	{ "mm3_settings",      mm3_settings_addr,   0,      0,      0    },
+	{ "mm3_select",        mm3_select_addr+1,   0,      0,      0    },
+	{ NULL, 0, 0, 0, 0 }
+};
+
+int cycles_run(const cycles_test* t)
+{
+	cpu_state c;
+	int i;
+
+	memset(&c, 0, sizeof(c));
+	c.r[2] = t->dx;
+	c.r[4] = 0xFFF0;
+	c.flags = F_IF | 0x0002;
+	c.halt_addr = t->halt_addr;
+	c.halt_value = t->halt_value;
+	cpu_push(&c, CYCLES_RETURN);
+	c.ip = t->addr;
+	while (!c.done)
+	{
+		if (c.ip == CYCLES_RETURN && c.r[4] == 0xFFF0) c.done = 1;
+		else if (!cpu_is_loaded(c.ip)) c.done = 2;
+		else if (c.count >= CYCLES_LIMIT) c.done = -1;
+		else cpu_step(&c);
+	}
+	printf("%-20s %8lu", t->name, (unsigned long)c.count);
+	for (i=0; i<CPU_COUNT; ++i) printf(" %9lu", (unsigned long)c.cycles[i]);
+	printf(" %6lu %5lu %5lu %s\n", (unsigned long)c.reads, (unsigned long)c.calls, (unsigned long)c.halts,
+		c.done == 1 ? "ret" : c.done == 2 ? "jmp" : "FAIL");
+	return c.done < 0;
+}
+
+int cycles()
+{
+	const cycles_test* t;
+	int i, failed = 0;
+
+	cpu_mem = malloc(0x10000UL);
+	if (cpu_mem == NULL)
+	{
+		printf("Out of memory.\n");
+		return 6;
+	}
+	printf("Injected routine cost, from %u port reads per frame with %u of retrace:\n\n",
+		CYCLES_FRAME, CYCLES_RETRACE);
+	printf("%-20s %8s", "routine", "instr");
+	for (i=0; i<CPU_COUNT; ++i) printf(" %9s", cpu_names[i]);
+	printf(" %6s %5s %5s\n", "reads", "calls", "halts");
+
+	// Mega Man's patches are at a fixed distance from their file offsets
+	memset(cpu_mem, 0, 0x10000UL);
+	memset(cpu_loaded, 0, sizeof(cpu_loaded));
+	cpu_load(mm1_patch, (long)mm1_slow_addr - mm1_slow_file, 0, 0xFFFF);
+	cpu_load(mm1_poll_patch, (long)mm1_slow_addr - mm1_slow_file, 0, 0xFFFF);
+	for (t = cycles_mm1; t->name != NULL; ++t) failed |= cycles_run(t);
+
+	// Mega Man 3's are only linear within the dead Tandy code
+	memset(cpu_mem, 0, 0x10000UL);
+	memset(cpu_loaded, 0, sizeof(cpu_loaded));
+	cpu_load(mm3_patch, (long)mm3_slow_addr - mm3_slow_file, mm3_slow_file, mm3_select_file + LENGTH(mm3_select));
+	cpu_load(mm3_poll_patch, (long)mm3_slow_addr - mm3_slow_file, mm3_slow_file, mm3_select_file);
+	for (t = cycles_mm3; t->name != NULL; ++t) failed |= cycles_run(t);
+
+	free(cpu_mem);
+	return failed;
+}
+#endif
+
+// prints the -stats report, or writes it as JSON
+void stats_print(FILE* f, int json, double total, const patch* patches)
+{
+	int i, count;
+
+	count = 0;
+	if (patches != NULL)
+		while (patches[count].length != 0) ++count;
+
+	if (json)
+	{
+		fprintf(f,"{\n\t\"total_ms\": %.3f,\n\t\"phases\": {\n",total * 1000.0);
+		for (i=0; i<PHASE_COUNT; ++i)
+			fprintf(f,"\t\t\"%s\": { \"ms\": %.3f, \"io_calls\": %lu }%s\n",
+				phase_names[i], phase_time[i] * 1000.0, (unsigned long)phase_calls[i],
+				(i+1 < PHASE_COUNT) ? "," : "");
+		fprintf(f,"\t},\n\t\"patches\": [");
+		for (i=0; i<count; ++i)
+			fprintf(f,"%s\n\t\t{ \"addr\": %u, \"length\": %u, \"applied\": %lu }",
+				i ? "," : "", patches[i].addr, patches[i].length, (unsigned long)patch_applied[i]);
+		fprintf(f,"%s]\n}\n",count ? "\n\t" : "");
+		return;
+	}
+
+	fprintf(f,"\n%-9s %10s %9s\n","phase","ms","io calls");
+	for (i=0; i<PHASE_COUNT; ++i)
+		fprintf(f,"%-9s %10.3f %9lu\n",phase_names[i],phase_time[i] * 1000.0,(unsigned long)phase_calls[i]);
+	fprintf(f,"%-9s %10.3f %9lu\n","total",total * 1000.0,(unsigned long)io_calls);
+	if (count > 0)
+	{
+		fprintf(f,"\npatch  addr  length  applied\n");
+		for (i=0; i<count; ++i)
+			fprintf(f,"%5d  %04X  %6u  %7lu\n",i,patches[i].addr,patches[i].length,(unsigned long)patch_applied[i]);
+	}
+}
+
+// patches a file loaded by load_file, or writes it unpacked with -unpack
+// returns -1 if patch_file should be used instead
+int patch_loaded(uint8* data, uint32 size, uint32 crc, const char* filename_in, const char* filename_out, const patch* const patches, uint32* crc_out)
+{
+	if (unpack)
+	{
+		if (data != NULL) return patch_unpacked(data, size, filename_out, patches, crc_out);
+		printf("Unable to load %s to unpack.\n", filename_in);
+		return 2;
+	}
+	if (data == NULL) return -1;
+	return patch_memory(data, size, crc, filename_in, filename_out, patches, crc_out);
+}
+
+// patches MM.EXE in the current directory, returns the patch set used in applied
+int patch_single(const patch** applied)
+{
+	uint32 crc, crc_out, size;
+	uint8* data;
+	const patch* set;
+	int build, i;
+	int result = 0;
+
+	printf("Opening " FILE_CRC "...\n");
+	stats_phase(PHASE_OPEN);
+	if (!TEST && !force && (build = cache_lookup(FILE_CRC, &crc)) >= 0)
+	{
+		stats_phase(-1);
+		printf("CRC32: %08lX\n", (unsigned long)crc);
+		printf("%s is already up to date.\n", games[build].output);
+		*applied = game_patches(build);
+		return 0;
+	}
+	data = load_file(FILE_CRC, &size);
+	stats_phase(PHASE_IDENTIFY);
+	if (data != NULL) crc = ~crc32_update(0xFFFFFFFFUL, data, (uint)size);
+	else              crc = crc32(FILE_CRC);
+	stats_phase(-1);
+	printf("CRC32: %08lX\n", crc);
+
+	// TEST patches every build's input in turn
+	build = identify(crc);
+	for (i=0; i<GAMES; ++i)
+	{
+		if (i != build && !TEST) continue;
+		set = game_patches(i);
+		printf("\n");
+		*applied = set;
+		result = -1;
+		if (!TEST) result = patch_loaded(data, size, crc, games[i].input, games[i].output, set, &crc_out);
+		if (result < 0)
+		{
+			result = patch_file(games[i].input, games[i].output, set);
+			// patch_file doesn't see its output, so its CRC32 is read back for the cache
+			if (result == 0 && !TEST && !crc32_file(games[i].output, &crc_out)) continue;
+		}
+		if (result) return result;
+		if (!TEST) cache_store(games[i].input, crc, set, games[i].output, crc_out);
+	}
+	if (build < 0)
+	{
+		printf("Unrecognized CRC32. Expected:\n");
+		for (i=0; i<GAMES; ++i)
+			printf("  %08lX - %s\n",(unsigned long)games[i].crc,games[i].name);
+		result = 1;
+		if (scan_enabled)
+		{
+			printf("\nScanning " FILE_CRC " for patch sites...\n");
+			if (data == NULL) printf("Unable to load " FILE_CRC " to scan.\n");
+			else if ((build = scan(data, size, &set)) >= 0)
+			{
+				printf("\n");
+				*applied = set;
+				result = patch_loaded(data, size, crc, FILE_CRC, games[build].output, set, &crc_out);
+				if (result < 0) result = patch_file(FILE_CRC, games[build].output, set);
+			}
+		}
+	}
+
+	free(data);
+	return result;
+}
+
+//
+// Streaming (-stream): patches standard input to standard output, for a pipeline with no MM.EXE on disk.
+//
+
+// Nothing patched can be written until the game is chosen, but the CRC32 that identifies it
+// isn't known until the input ends. The input is held back in a window until every fingerprint
+// sample of both games has passed, and the game is chosen by those samples. The window is then
+// patched and written, and the rest of the input is patched a block at a time as it passes through.
+// The input CRC32 confirms the choice at the end, and the output is verified as in patch_buffer.
+// Either failure is only reported after the output has been written, so the exit code must be checked.
+
+typedef struct
+{
+	const patch* patches;
+	uint8 order[MAX_PATCHES];
+	int count;
+	int next;         // first patch in order not yet finished
+	uint32 end;       // end of the last patch finished
+	uint32 delta;     // raw CRC32 of the input XOR the output, up to delta_pos
+	uint32 delta_pos;
+	uint32 patched;
+} stream_state;
+
+// applies the patches that fall in data, which holds n bytes of the input from offset pos
+// a patch that runs past the end of data is continued by the next call
+void stream_patch(stream_state* s, uint8* data, uint32 pos, uint n)
+{
+	const patch* p;
+	uint32 start, end, j;
+
+	while (s->next < s->count)
+	{
+		p = s->patches + s->order[s->next];
+		if (p->addr < s->end) // inside an earlier patch, never reached
+		{
+			++s->next;
+			continue;
+		}
+		if (p->addr >= (pos + n)) break;
+		start = (p->addr > pos) ? p->addr : pos;
+		end = (uint32)p->addr + p->length;
+		if (end > (pos + n)) end = pos + n;
+		if (start == p->addr) note_patch(s->order[s->next],p);
+		s->delta = crc32_zeros(s->delta,start - s->delta_pos);
+		for (j=start; j<end; ++j)
+		{
+			s->delta = (s->delta >> 8) ^ crc_table[0][(s->delta ^ data[j-pos] ^ p->data[j-p->addr]) & 0xFF];
+			data[j-pos] = p->data[j-p->addr];
+		}
+		s->delta_pos = end;
+		s->patched += end - start;
+		if (end < ((uint32)p->addr + p->length)) break;
+		s->end = end;
+		++s->next;
+	}
+}
+
+int stream(const patch** applied)
+{
+	stream_state s;
+	uint8* window;
+	uint8* data;
+	uint32 window_size, pos, crc, crc_out, expected;
+	uint n;
+	int build;
+	int result = 0;
+
+	window_size = 1;
+	for (build=0; build<GAMES; ++build)
+		if (patch_extent(games[build].fingerprint) > window_size) window_size = patch_extent(games[build].fingerprint);
+	window = malloc(window_size);
+	if (window == NULL)
+	{
+		fprintf(stderr,"Out of memory.\n");
+		return 6;
+	}
+#if !defined(__unix__)
+	setmode(fileno(stdin),O_BINARY);
+	setmode(fileno(stdout),O_BINARY);
+#endif
+	if (!crc_table_ready) crc32_init();
+
+	stats_phase(PHASE_IDENTIFY);
+	n = fread(window,1,window_size,stdin);
+	++io_calls;
+	for (build=0; build<GAMES; ++build)
+		if (fingerprint_data(window, n, games[build].fingerprint)) break;
+	if (build >= GAMES)
+	{
+		stats_phase(-1);
+		free(window);
+		fprintf(stderr,"Unrecognized input, nothing written.\n");
+		return 1;
+	}
+	s.patches = game_patches(build);
+	*applied = s.patches;
+	s.count = sort_patches(s.patches, s.order);
+	if (s.count < 0)
+	{
+		stats_phase(-1);
+		free(window);
+		fprintf(stderr,"Too many patches.\n");
+		return 4;
+	}
+	if (!quiet) fprintf(stderr,"Patching %s from standard input...\n", games[build].name);
+	s.next = 0;
+	s.end = 0;
+	s.delta = 0;
+	s.delta_pos = 0;
+	s.patched = 0;
+
+	crc = 0xFFFFFFFFUL;
+	crc_out = 0xFFFFFFFFUL;
+	pos = 0;
+	data = window;
+	while (n > 0)
+	{
+		stats_phase(PHASE_PATCH);
+		crc = crc32_update(crc,data,n);
+		stream_patch(&s,data,pos,n);
+		crc_out = crc32_update(crc_out,data,n);
+		stats_phase(PHASE_WRITE);
+		++io_calls;
+		if (fwrite(data,1,n,stdout) != n)
+		{
+			result = 3;
+			break;
+		}
+		pos += n;
+		stats_phase(PHASE_COPY);
+		data = block;
+		n = fread(block,1,BLOCK_SIZE,stdin);
+		++io_calls;
+	}
+	stream_patch(&s,NULL,pos,0); // passes over any patches inside the last one
+	stats_phase(-1);
+	free(window);
+	if (ferror(stdin))
+	{
+		fprintf(stderr,"Unable to read standard input.\n");
+		return 2;
+	}
+	if (fflush(stdout) != 0 || ferror(stdout)) result = 3;
+	if (result)
+	{
+		fprintf(stderr,"Unable to write standard output.\n");
+		return result;
+	}
+
+	crc = ~crc;
+	crc_out = ~crc_out;
+	s.delta = crc32_zeros(s.delta,pos - s.delta_pos);
+	expected = crc ^ s.delta;
+	if (!quiet)
+	{
+		fprintf(stderr,"CRC32: %08lX\n",(unsigned long)crc);
+		fprintf(stderr,"%lu bytes copied, %lu bytes patched.\n",(unsigned long)(pos - s.patched),(unsigned long)s.patched);
+		fprintf(stderr,"Output CRC32: %08lX\n",(unsigned long)crc_out);
+	}
+	if (identify(crc) != build)
+	{
+		fprintf(stderr,"Unrecognized CRC32, the output is not usable. Expected: %08lX\n",(unsigned long)games[build].crc);
+		return 1;
+	}
+	if (s.next < s.count || crc_out != expected)
+	{
+		fprintf(stderr,"Output verification failed, expected: %08lX\n",(unsigned long)expected);
+		return 5;
+	}
+	return 0;
+}
+
+#if FUZZ
+//
+// Differential test: runs every patch engine and CRC32 on generated inputs and patch tables,
+// and compares them with a per-byte reference, the original patch_file and crc32 on buffers.
+//
+
+// Each case is built from a string of bytes, so libFuzzer can explore them with FUZZ 2,
+// and FUZZ 1 runs FUZZ_CASES of them from a fixed seed. The bytes choose the input's size and seed,
+// and a table of non-overlapping patches listed in shuffled order. Gaps are often 0, so patches
+// start at offset 0 and sit next to each other, and the last often ends exactly at the end of the input.
+// Sizes reach past 16 blocks, where patch_file maps the files or clones them instead of using stdio.
+//
+// Engines compared: crc32_update and crc32, patch_buffer with its predicted CRC32, stream_patch
+// in random chunks, write_file, and patch_file with stdio, mmap and reflink.
+
+#define FUZZ_IN     "FUZZIN.BIN"
+#define FUZZ_OUT    "FUZZOUT.BIN"
+#define FUZZ_CASES  2000
+#define FUZZ_SEED   64 // bytes of seed for each FUZZ 1 case
+
+typedef struct
+{
+	const uint8* data;
+	size_t size;
+	size_t pos;
+	uint32 state;
+} fuzz_source;
+
+// the next seed byte, or 0 past the end
+uint fuzz_byte(fuzz_source* s)
+{
+	return (s->pos < s->size) ? s->data[s->pos++] : 0;
+}
+
+// pseudo-random numbers for input contents and chunk sizes, seeded from the case
+uint32 fuzz_rand(fuzz_source* s)
+{
+	s->state ^= s->state << 13;
+	s->state ^= s->state >> 17;
+	s->state ^= s->state << 5;
+	return s->state;
+}
+
+// the original bitwise crc32
+uint32 fuzz_crc(const uint8* data, uint32 size)
+{
+	uint32 crc, mask;
+	uint32 j;
+	int i;
+
+	crc = 0xFFFFFFFFUL;
+	for (j=0; j<size; ++j)
+	{
+		crc = crc ^ data[j];
+		for (i=0; i<8; ++i)
+		{
+			mask = -(crc & 1);
+			crc = (crc >> 1) ^ (0xEDB88320 & mask);
+		}
+	}
+	return ~crc;
+}
+
+// the original byte-by-byte patch_file: at each position the first patch listed that starts there
+// replaces the input, returns the output size
+uint32 fuzz_reference(const uint8* in, uint32 size, const patch* patches, uint8* out)
+{
+	uint32 pos = 0, o = 0;
+	const patch* p;
+	uint i;
+
+	while (1)
+	{
+		for (p = patches; p->length != 0; ++p)
+			if (pos == p->addr) break;
+		if (p->length != 0)
+		{
+			for (i=0; i<p->length; ++i)
+				out[o++] = p->data[i];
+			pos += p->length;
+			continue;
+		}
+		if (pos >= size) break;
+		out[o++] = in[pos++];
+	}
+	return o;
+}
+
+// loads FUZZ_OUT and compares it to the reference
+int fuzz_compare_file(const uint8* ref, uint32 size)
+{
+	uint8* data;
+	uint32 length;
+	int same;
+
+	data = load_file(FUZZ_OUT, &length);
+	if (data == NULL) return 0;
+	same = (length == size) && !memcmp(data, ref, size);
+	free(data);
+	return same;
+}
+
+// runs one case, returns NULL if every engine matches the reference, or the name of one that doesn't
+const char* fuzz_case(const uint8* seed, size_t seed_size)
+{
+	static patch patches[MAX_PATCHES+1];
+	static uint8 pool[256];
+	fuzz_source s;
+	uint8* in;
+	uint8* out;
+	uint8* ref;
+	FILE* f;
+	stream_state st;
+	patch_result r;
+	patch t;
+	uint32 size, pos, gap, length, crc_in, crc_ref, crc;
+	uint n;
+	int count, i, j;
+	const char* failed = NULL;
+
+	s.data = seed;
+	s.size = seed_size;
+	s.pos = 0;
+	size = fuzz_byte(&s);
+	size |= fuzz_byte(&s) << 8;
+	if (fuzz_byte(&s) & 1) size += 16UL * BLOCK_SIZE;
+	s.state = fuzz_byte(&s) | (fuzz_byte(&s) << 8) | ((uint32)fuzz_byte(&s) << 16) | 1;
+	in = malloc(size + 1);
+	out = malloc(size + 1);
+	ref = malloc(size + 1);
+	if (in == NULL || out == NULL || ref == NULL)
+	{
+		free(in);
+		free(out);
+		free(ref);
+		return "malloc";
+	}
+	for (pos=0; pos<size; ++pos) in[pos] = (uint8)fuzz_rand(&s);
+	for (i=0; i<(int)sizeof(pool); ++i) pool[i] = (uint8)fuzz_rand(&s);
+
+	// non-overlapping patches in file order, then shuffled
+	count = fuzz_byte(&s) % MAX_PATCHES;
+	pos = 0;
+	for (i=0; i<count && pos<size; ++i)
+	{
+		n = fuzz_byte(&s);
+		gap = (n & 3) ? (fuzz_rand(&s) % ((size / (count + 1)) + 1)) : 0;
+		length = 1 + ((n >> 2) % 48);
+		if ((pos + gap) >= size) break;
+		pos += gap;
+		if (length > (size - pos)) length = size - pos;
+		patches[i].addr = (uint)pos;
+		patches[i].length = (uint)length;
+		patches[i].data = pool + (fuzz_rand(&s) % (sizeof(pool) - 48));
+		pos += length;
+	}
+	count = i;
+	if (count > 0 && (fuzz_byte(&s) & 1)) // end the last patch at the end of the input
+	{
+		length = size - patches[count-1].addr;
+		if (length <= (sizeof(pool) - (patches[count-1].data - pool))) patches[count-1].length = (uint)length;
+	}
+	for (i=count-1; i>0; --i)
+	{
+		j = fuzz_rand(&s) % (i + 1);
+		t = patches[i];
+		patches[i] = patches[j];
+		patches[j] = t;
+	}
+	patches[count].addr = 0;
+	patches[count].length = 0;
+	patches[count].data = NULL;
+
+	length = fuzz_reference(in, size, patches, ref);
+	crc_in = fuzz_crc(in, size);
+	crc_ref = fuzz_crc(ref, length);
+	if (length != size) failed = "reference";
+
+	// CRC32
+	if (!failed && ~crc32_update(0xFFFFFFFFUL, in, (uint)size) != crc_in) failed = "crc32_update";
+	f = fopen(FUZZ_IN,"wb");
+	if (!failed && (f == NULL || fwrite(in,1,size,f) != size)) failed = "write " FUZZ_IN;
+	if (f != NULL) fclose(f);
+	if (!failed && crc32(FUZZ_IN) != crc_in) failed = "crc32";
+
+	// in memory
+	memcpy(out, in, size);
+	if (!failed && (patch_buffer(out, size, crc_in, patches, &r) != 0 || memcmp(out, ref, size))) failed = "patch_buffer";
+	if (!failed && (r.crc != crc_ref || r.expected != crc_ref)) failed = "patch_buffer crc";
+	if (!failed && (write_file(FUZZ_IN, FUZZ_OUT, out, size, r.crc, patches) || !fuzz_compare_file(ref, size))) failed = "write_file";
+
+	// streaming, in chunks of 1 byte up to a few blocks
+	memcpy(out, in, size);
+	st.patches = patches;
+	st.count = sort_patches(patches, st.order);
+	st.next = 0;
+	st.end = 0;
+	st.delta = 0;
+	st.delta_pos = 0;
+	st.patched = 0;
+	for (pos=0; pos<size; pos+=n)
+	{
+		n = (fuzz_rand(&s) & 1) ? (1 + (fuzz_rand(&s) % 16)) : (1 + (fuzz_rand(&s) % (3 * BLOCK_SIZE)));
+		if (n > (size - pos)) n = (uint)(size - pos);
+		stream_patch(&st, out + pos, pos, n);
+	}
+	stream_patch(&st, NULL, size, 0);
+	crc = crc_in ^ crc32_zeros(st.delta, size - st.delta_pos);
+	if (!failed && (memcmp(out, ref, size) || crc != crc_ref)) failed = "stream_patch";
+
+	// from file to file
+	engines = 0;
+	if (!failed && (patch_file(FUZZ_IN, FUZZ_OUT, patches) || !fuzz_compare_file(ref, size))) failed = "patch_file stdio";
+	engines = ENGINE_MMAP;
+	if (!failed && (patch_file(FUZZ_IN, FUZZ_OUT, patches) || !fuzz_compare_file(ref, size))) failed = "patch_file mmap";
+	engines = ENGINE_REFLINK;
+	if (!failed && (patch_file(FUZZ_IN, FUZZ_OUT, patches) || !fuzz_compare_file(ref, size))) failed = "patch_file reflink";
+	engines = ENGINE_MMAP | ENGINE_REFLINK;
+
+	if (failed)
+	{
+		printf("%s differs: %lu bytes, %d patches\n", failed, (unsigned long)size, count);
+		for (i=0; i<count; ++i)
+			printf("  %08X: %u bytes\n", patches[i].addr, patches[i].length);
+	}
+	free(in);
+	free(out);
+	free(ref);
+	return failed;
+}
+
+#if FUZZ == 2
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	quiet = 1;
+	if (fuzz_case(data, size) != NULL) abort();
+	return 0;
+}
+#else
+int fuzz()
+{
+	fuzz_source s;
+	uint8 seed[FUZZ_SEED];
+	int c, i;
+	int result = 0;
+
+	quiet = 1;
+	s.state = 1;
+	for (c=0; c<FUZZ_CASES; ++c)
+	{
+		for (i=0; i<FUZZ_SEED; ++i) seed[i] = (uint8)fuzz_rand(&s);
+		if (fuzz_case(seed, sizeof(seed)) != NULL)
+		{
+			printf("Case %d failed.\n", c);
+			result = 5;
+			break;
+		}
+		if ((c % 100) == 0)
+		{
+			printf("\r%d / %d", c, FUZZ_CASES);
+			fflush(stdout);
+		}
+	}
+	if (result == 0) printf("\r%d / %d, every engine matches the reference.\n", c, FUZZ_CASES);
+	remove(FUZZ_IN);
+	remove(FUZZ_OUT);
+	return result;
+}
+#endif
+#endif
+
+#if !LIBRARY && FUZZ != 2
+int main(int argc, char** argv)
+{
+	const char* batch_dir = NULL;
+	const char* json = NULL;
+	const char* analyze_file = NULL;
+	const char* image = NULL;
+	const patch* applied = NULL;
+	FILE* f;
+	double start;
+	uint options = 0;
+	int streaming = 0;
+	int i, result;
+
+#if BENCH
+	return bench();
+#endif
+#if CYCLES
+	return cycles();
+#endif
+#if FUZZ
+	return fuzz();
+#endif
+	for (i=1; i<argc; ++i)
+	{
+		if      (!strcmp(argv[i],"-debug")) debug = 1;
+		else if (!strcmp(argv[i],"-stats")) stats = 1;
+		else if (!strcmp(argv[i],"-json") && (i+1) < argc) json = argv[++i];
+		else if (!strcmp(argv[i],"-batch") && (i+1) < argc) batch_dir = argv[++i];
+		else if (!strcmp(argv[i],"-poll")) options |= OPTION_POLL;
+		else if (!strcmp(argv[i],"-timer")) options |= OPTION_TIMER;
+		else if (!strcmp(argv[i],"-telemetry")) options |= OPTION_TELEMETRY;
+		else if (!strcmp(argv[i],"-adaptive")) options |= OPTION_ADAPTIVE;
+		else if (!strcmp(argv[i],"-analyze") && (i+1) < argc) analyze_file = argv[++i];
+		else if (!strcmp(argv[i],"-scan")) scan_enabled = 1;
+		else if (!strcmp(argv[i],"-unpack")) unpack = 1;
+		else if (!strcmp(argv[i],"-stream")) streaming = 1;
+		else if (!strcmp(argv[i],"-force")) force = 1;
+		else if (!strcmp(argv[i],"-image") && (i+1) < argc) image = argv[++i];
+		else if (!strcmp(argv[i],"-inplace")) inplace = 1;
+		else break;
+	}
+	if (i < argc || !set_options(options) || (batch_dir != NULL && (debug || stats || json != NULL || scan_enabled || unpack)) ||
+		(streaming && (batch_dir != NULL || debug || scan_enabled || unpack)) ||
+		(image != NULL && (batch_dir != NULL || streaming || scan_enabled || unpack)) || (inplace && image == NULL))
+	{
+		printf("Usage:\n");
+		printf("  MMPATCH [options]         patches " FILE_CRC " in the current directory\n");
+		printf("  MMPATCH -batch directory  patches every " FILE_CRC " in a directory tree\n");
+		printf("  MMPATCH -stream           patches standard input to standard output\n");
+		printf("  MMPATCH -image file       patches " FILE_CRC " in a FAT12 or FAT16 disk image\n");
+		printf("  MMPATCH -analyze file     reports on a -telemetry " FRAMES_FILE "\n");
+		printf("Options:\n");
+		printf("  -poll        also limit the wait screens and other input polls\n");
+		printf("  -timer       limit the frame rate with a timer interrupt instead of the video\n");
+		printf("  -adaptive    count the game's own time toward the speed setting (not with -timer)\n");
+		printf("  -telemetry   record frame times to " FRAMES_FILE " (not with -timer or -adaptive)\n");
+		printf("  -scan        search an unrecognized " FILE_CRC " for the patch sites\n");
+		printf("  -unpack      write the output unpacked, so it starts without decompressing\n");
+		printf("  -force       patch again even if the output is already up to date\n");
+		printf("  -inplace     with -image, patch " FILE_CRC " itself instead of adding a new file\n");
+		printf("  -debug       list each patch applied (not with -batch or -stream)\n");
+		printf("  -stats       report time and I/O calls for each phase\n");
+		printf("  -json file   write the -stats report to a file as JSON\n");
+		return 1;
+	}
+	if (analyze_file != NULL) return analyze(analyze_file);
+	if (batch_dir != NULL) return batch(batch_dir);
+
+	if (json != NULL) stats = 1;
+	start = now();
+	if      (image != NULL) result = patch_image(image, &applied);
+	else if (streaming)     result = stream(&applied);
+	else                    result = patch_single(&applied);
+	if (json != NULL)
+	{
+		f = fopen(json,"w");
+		if (f == NULL) fprintf(streaming ? stderr : stdout,"Unable to open: %s\n",json);
+		else
+		{
+			stats_print(f, 1, now() - start, applied);
+			fclose(f);
+		}
+	}
+	else if (stats) stats_print(streaming ? stderr : stdout, 0, now() - start, applied);
+	return result;
+}
+#endif